@@ -0,0 +1,139 @@
+// Compares the document types JSONDOMWriter could build on a real dump: the default nlohmann::json
+// (std::map objects, global allocator), std::map objects in an arena, and the ArenaJSON it uses
+// (sorted vector objects in an arena).
+//
+// Built from the root of the repository with:
+//   clang++ -std=c++14 -O2 $(llvm-config --cxxflags) -Isrc -Iinclude -o bin/object_storage_bench
+//     bench/object_storage.cpp $(llvm-config --ldflags --libs support --system-libs)
+//   bin/json_serializer -compact file.h -- ... > dump.json
+//   bin/object_storage_bench dump.json
+
+#include "parsed_document.hpp"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <map>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+namespace {
+
+using MapArenaJSON = nlohmann::basic_json<std::map, std::vector, ArenaString, bool, int64_t,
+                                          uint64_t, double, ArenaAllocator>;
+
+// The same as JSONDOMWriter, for any document type and filling a document owned by the caller.
+template <class Document>
+class BenchDOMWriter : public JSONWriter {
+public:
+  using String = typename Document::string_t;
+
+  explicit BenchDOMWriter(Document &root) : root(root) {}
+
+  virtual auto start_object() -> void override { stack.push_back(&add(Document::object())); }
+  virtual auto end_object() -> void override { stack.pop_back(); }
+  virtual auto start_array() -> void override { stack.push_back(&add(Document::array())); }
+  virtual auto end_array() -> void override { stack.pop_back(); }
+  virtual auto key(llvm::StringRef key) -> void override {
+    pending_key.assign(key.data(), key.size());
+  }
+  virtual auto string(llvm::StringRef value) -> void override {
+    add(String(value.data(), value.size()));
+  }
+  virtual auto boolean(bool value) -> void override { add(value); }
+  virtual auto number_unsigned(uint64_t value) -> void override { add(value); }
+  virtual auto null() -> void override { add(nullptr); }
+
+private:
+  Document &root;
+  std::vector<Document *> stack;
+  String pending_key;
+
+  auto add(Document value) -> Document & {
+    if (stack.empty()) {
+      return root = std::move(value);
+    }
+    auto &parent = *stack.back();
+    if (parent.is_object()) {
+      return parent[pending_key] = std::move(value);
+    }
+    parent.push_back(std::move(value));
+    return parent.back();
+  }
+};
+
+auto elapsed_ms(std::chrono::steady_clock::time_point start) -> double {
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+auto report(char const *name, double build_ms, double write_ms, double release_ms) -> void {
+  llvm::outs() << llvm::format("%-28s build %8.1f ms  write %8.1f ms  release %8.1f ms\n", name,
+                               build_ms, write_ms, release_ms);
+}
+
+// The document is written to MessagePack to include the iteration in the timings.
+template <class Document>
+auto run(char const *name, nlohmann::json const &dump) -> void {
+  std::string output;
+  llvm::raw_string_ostream out(output);
+  auto start = std::chrono::steady_clock::now();
+  auto document = std::make_unique<Document>();
+  BenchDOMWriter<Document> writer{*document};
+  write_parsed_document(dump, writer);
+  auto build_ms = elapsed_ms(start);
+  start = std::chrono::steady_clock::now();
+  nlohmann::detail::binary_writer<Document, char>{std::make_shared<RawOstreamOutputAdapter>(out)}
+      .write_msgpack(*document);
+  out.flush();
+  auto write_ms = elapsed_ms(start);
+  start = std::chrono::steady_clock::now();
+  document.reset();
+  report(name, build_ms, write_ms, elapsed_ms(start));
+}
+
+template <class Document>
+auto run_in_arena(char const *name, nlohmann::json const &dump) -> void {
+  JSONArena arena;
+  JSONArena::Scope scope{arena};
+  std::string output;
+  llvm::raw_string_ostream out(output);
+  auto start = std::chrono::steady_clock::now();
+  // Never destroyed, the arena frees it
+  auto document = new (arena.allocate(sizeof(Document), alignof(Document))) Document();
+  BenchDOMWriter<Document> writer{*document};
+  write_parsed_document(dump, writer);
+  auto build_ms = elapsed_ms(start);
+  start = std::chrono::steady_clock::now();
+  nlohmann::detail::binary_writer<Document, char>{std::make_shared<RawOstreamOutputAdapter>(out)}
+      .write_msgpack(*document);
+  out.flush();
+  auto write_ms = elapsed_ms(start);
+  auto allocations = arena.allocation_count();
+  auto bytes = arena.bytes_allocated();
+  start = std::chrono::steady_clock::now();
+  arena.release();
+  report(name, build_ms, write_ms, elapsed_ms(start));
+  llvm::outs() << "  " << allocations << " allocations, " << bytes << " bytes\n";
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (argc < 2) {
+    llvm::errs() << "usage: " << argv[0] << " dump.json\n";
+    return 1;
+  }
+  nlohmann::json dump;
+  if (!parse_dump(argv[1], dump)) {
+    return 1;
+  }
+  llvm::outs() << dump["children"].size() << " top-level decls\n";
+  run<nlohmann::json>("std::map, malloc", dump);
+  run_in_arena<MapArenaJSON>("std::map, arena", dump);
+  run_in_arena<ArenaJSON>("FlatMap, arena (ArenaJSON)", dump);
+  return 0;
+}
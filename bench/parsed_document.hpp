@@ -0,0 +1,56 @@
+#ifndef CHOCOLATIER_BENCH_PARSED_DOCUMENT_HPP
+#define CHOCOLATIER_BENCH_PARSED_DOCUMENT_HPP
+
+#include "json_writer.hpp"
+
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+// The benchmarks replay a real dump of json_serializer (written with -compact), parsed once, so
+// that the writers see the events serialize_decl produces.
+
+// Returns false after reporting the error if the file cannot be read.
+inline auto parse_dump(char const *path, nlohmann::json &document) -> bool {
+  auto buffer = llvm::MemoryBuffer::getFile(path);
+  if (!buffer) {
+    llvm::errs() << "Could not read " << path << "\n";
+    return false;
+  }
+  document = nlohmann::json::parse((*buffer)->getBuffer().begin(), (*buffer)->getBuffer().end());
+  return true;
+}
+
+// The same as write_json_document, for the document as parsed.
+inline auto write_parsed_document(nlohmann::json const &document, JSONWriter &writer) -> void {
+  switch (document.type()) {
+  case nlohmann::json::value_t::object:
+    writer.start_object();
+    for (auto it = document.cbegin(); it != document.cend(); ++it) {
+      writer.key(it.key());
+      write_parsed_document(it.value(), writer);
+    }
+    writer.end_object();
+    break;
+  case nlohmann::json::value_t::array:
+    writer.start_array();
+    for (auto const &element : document) {
+      write_parsed_document(element, writer);
+    }
+    writer.end_array();
+    break;
+  case nlohmann::json::value_t::string:
+    writer.string(document.get_ref<std::string const &>());
+    break;
+  case nlohmann::json::value_t::boolean:
+    writer.boolean(document.get<bool>());
+    break;
+  case nlohmann::json::value_t::number_unsigned:
+    writer.number_unsigned(document.get<uint64_t>());
+    break;
+  default:
+    writer.null();
+    break;
+  }
+}
+
+#endif
@@ -0,0 +1,130 @@
+// Times the parts of JSONTextWriter that dominate on a real dump: finding the characters to escape
+// in strings (byte by byte and with the SIMD scan), formatting integers (raw_ostream and
+// format_decimal), and writing the whole dump back.
+//
+// Built from the root of the repository with:
+//   clang++ -std=c++14 -O2 $(llvm-config --cxxflags) -Isrc -Iinclude -o bin/text_writer_bench
+//     bench/text_writer.cpp $(llvm-config --ldflags --libs support --system-libs)
+//   bin/json_serializer -compact file.h -- ... > dump.json
+//   bin/text_writer_bench dump.json [iterations]
+
+#include "parsed_document.hpp"
+#include "text_encoding.hpp"
+
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+namespace {
+
+auto collect_values(nlohmann::json const &value, std::vector<std::string> &strings,
+                    std::vector<uint64_t> &numbers) -> void {
+  switch (value.type()) {
+  case nlohmann::json::value_t::object:
+    for (auto it = value.cbegin(); it != value.cend(); ++it) {
+      strings.push_back(it.key());
+      collect_values(it.value(), strings, numbers);
+    }
+    break;
+  case nlohmann::json::value_t::array:
+    for (auto const &element : value) {
+      collect_values(element, strings, numbers);
+    }
+    break;
+  case nlohmann::json::value_t::string:
+    strings.push_back(value.get<std::string>());
+    break;
+  case nlohmann::json::value_t::number_unsigned:
+    numbers.push_back(value.get<uint64_t>());
+    break;
+  default:
+    break;
+  }
+}
+
+template <class Function>
+auto time_ms(unsigned iterations, Function function) -> double {
+  auto start = std::chrono::steady_clock::now();
+  for (unsigned i = 0; i < iterations; ++i) {
+    function();
+  }
+  return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+             .count() /
+         iterations;
+}
+
+auto report(char const *name, double ms, uint64_t bytes) -> void {
+  llvm::outs() << llvm::format("%-36s %8.2f ms  %8.1f MB/s\n", name, ms,
+                               bytes / (ms / 1000) / (1024 * 1024));
+}
+
+} // namespace
+
+auto main(int argc, char **argv) -> int {
+  if (argc < 2) {
+    llvm::errs() << "usage: " << argv[0] << " dump.json [iterations]\n";
+    return 1;
+  }
+  unsigned iterations = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 10;
+  nlohmann::json document;
+  if (!parse_dump(argv[1], document)) {
+    return 1;
+  }
+  std::vector<std::string> strings;
+  std::vector<uint64_t> numbers;
+  collect_values(document, strings, numbers);
+  uint64_t string_bytes = 0;
+  for (auto const &string : strings) {
+    string_bytes += string.size();
+  }
+  llvm::outs() << strings.size() << " strings (" << string_bytes << " bytes), " << numbers.size()
+               << " numbers\n";
+
+  // Summed so that the scans are not optimized away
+  size_t checksum = 0;
+  auto scan = [&](size_t (*find)(char const *, size_t)) {
+    for (auto const &string : strings) {
+      checksum += find(string.data(), string.size());
+    }
+  };
+  report("escape scan, scalar", time_ms(iterations, [&] { scan(find_escaped_character_scalar); }),
+         string_bytes);
+  report("escape scan, SIMD", time_ms(iterations, [&] { scan(find_escaped_character); }),
+         string_bytes);
+
+  std::string output;
+  llvm::raw_string_ostream out(output);
+  auto numbers_ms = time_ms(iterations, [&] {
+    output.clear();
+    for (auto number : numbers) {
+      out << number;
+    }
+    out.flush();
+  });
+  auto number_bytes = output.size();
+  report("integers, raw_ostream", numbers_ms, number_bytes);
+  report("integers, format_decimal", time_ms(iterations, [&] {
+           output.clear();
+           char digits[max_decimal_digits];
+           for (auto number : numbers) {
+             auto start = format_decimal(number, digits + sizeof(digits));
+             out.write(start, digits + sizeof(digits) - start);
+           }
+           out.flush();
+         }),
+         number_bytes);
+
+  auto write_ms = time_ms(iterations, [&] {
+    output.clear();
+    JSONTextWriter writer{out, 0};
+    write_parsed_document(document, writer);
+    out.flush();
+  });
+  report("whole dump, JSONTextWriter", write_ms, output.size());
+  llvm::outs() << "checksum " << checksum << "\n";
+  return 0;
+}
@@ -0,0 +1,372 @@
+// Reader for the flat binary AST written by json_serializer --format=flat.
+//
+// The file is made of fixed-layout records linked by indices, so once mapped in memory any decl or
+// type can be accessed directly without parsing anything. This header has no dependency other than
+// the C++14 standard library and POSIX (for MappedFile).
+//
+// The records are written as they are in memory, so all integers are in the byte order of the
+// host that wrote the file and a file can only be read on a host with the same byte order.
+// Header::byte_order tells which one it is, so that validate() can report a file from a host with
+// the other byte order as such.
+//
+// Layout (every section starts on an 8 byte boundary):
+//   Header
+//   sections, located by Header::sections:
+//     StringOffsets  uint32_t per string, offset of the string in StringData
+//     StringData     NUL-terminated strings
+//     Decls          Decl records
+//     Types          Type records
+//     Params         Param records
+//     Refs           uint32_t lists referenced by Range fields (decl ids, type ids or string ids)
+//     DeclsByUSR     uint32_t decl ids sorted by USR, for lookups by USR
+//
+// References to strings, decls and types are indices in their section, no_index when absent.
+#ifndef CHOCOLATIER_FLAT_AST_HPP
+#define CHOCOLATIER_FLAT_AST_HPP
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace flat_ast {
+
+constexpr char magic[8] = {'C', 'H', 'O', 'C', 'F', 'L', 'A', 'T'};
+// To increment on any change of the layout
+constexpr uint32_t format_version = 2;
+constexpr uint32_t no_index = UINT32_MAX;
+// Read as swapped_byte_order on a host with the other byte order
+constexpr uint32_t byte_order_mark = 0x01020304;
+constexpr uint32_t swapped_byte_order = 0x04030201;
+
+enum Section : uint32_t {
+  StringOffsets,
+  StringData,
+  Decls,
+  Types,
+  Params,
+  Refs,
+  DeclsByUSR,
+  SectionCount,
+};
+
+struct Range {
+  uint32_t first;
+  uint32_t count;
+};
+
+struct SectionEntry {
+  uint64_t offset;
+  uint64_t size;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t section_count;
+  uint32_t byte_order; // byte_order_mark
+  uint32_t reserved;
+  SectionEntry sections[SectionCount];
+  // Decl ids (in Refs) of the children of the translation unit
+  Range top_level_decls;
+};
+
+enum DeclFlags : uint32_t {
+  DeclIsImplicit = 1 << 0,
+  DeclIsReferenced = 1 << 1,
+  DeclIsForwardDeclaration = 1 << 2,
+  DeclIsInstanceMethod = 1 << 3,
+  DeclIsVariadic = 1 << 4,
+  DeclIsClosed = 1 << 5,
+  DeclIsFlag = 1 << 6,
+  DeclHasBody = 1 << 7,
+  DeclSelfIsConsumed = 1 << 8,
+  DeclNSReturnsRetained = 1 << 9,
+  // implementation_control of methods and property_implementation of properties
+  DeclIsOptional = 1 << 10,
+  DeclIsRequired = 1 << 11,
+  DeclHasBitWidth = 1 << 12,
+};
+
+struct Decl {
+  uint32_t kind;      // string
+  uint32_t flags;     // DeclFlags
+  uint32_t usr;       // string
+  uint32_t name;      // string, the selector for methods
+  uint32_t file;      // string
+  uint32_t line;
+  uint32_t type;      // type: type, return_type of methods, integer_type of enums
+  uint32_t related;   // string: class_name of categories, super_class_usr of interfaces
+  uint32_t detail;    // string: tag_kind, method_family or value of enum constants
+  uint32_t bit_width; // only meaningful with DeclHasBitWidth
+  Range children;     // decls: children, fields or enumerators
+  Range params;       // params
+  Range protocols;    // strings
+  Range type_params;  // strings
+};
+
+enum TypeFlags : uint32_t {
+  TypeIsVariadic = 1 << 0,
+  TypeIsNonnull = 1 << 1,
+  TypeIsNullable = 1 << 2,
+  TypeNSReturnsRetained = 1 << 3,
+};
+
+struct Type {
+  uint64_t size;       // size of constant arrays, num_elements of vectors
+  uint32_t type_class; // string
+  uint32_t flags;      // TypeFlags
+  uint32_t name;       // string: name, keyword of elaborated types
+  uint32_t decl_usr;   // string: decl_usr, interface_usr of Objective-C objects
+  // type: pointee, element_type, return_type, inner_type, named_type, modified_type or base_type
+  uint32_t inner;
+  uint32_t reserved;
+  Range params;    // params of function prototypes
+  Range protocols; // strings
+  Range type_args; // types
+};
+
+enum ParamFlags : uint32_t {
+  ParamIsConsumed = 1 << 0,
+};
+
+struct Param {
+  uint32_t name; // string, no_index for the params of function prototypes
+  uint32_t type;
+  uint32_t flags; // ParamFlags
+};
+
+static_assert(sizeof(Decl) == 72, "the layout of Decl is part of the format");
+static_assert(sizeof(Type) == 56, "the layout of Type is part of the format");
+static_assert(sizeof(Param) == 12, "the layout of Param is part of the format");
+
+template <class T> class Span {
+public:
+  Span(T const *data, uint32_t size) : data_(data), size_(size) {}
+  auto begin() const -> T const * { return data_; }
+  auto end() const -> T const * { return data_ + size_; }
+  auto size() const -> uint32_t { return size_; }
+  auto empty() const -> bool { return size_ == 0; }
+  auto operator[](uint32_t i) const -> T const & { return data_[i]; }
+
+private:
+  T const *data_;
+  uint32_t size_;
+};
+
+class Reader {
+public:
+  // The data must stay valid as long as the reader is used, and must come from a file that passed
+  // validate().
+  explicit Reader(void const *data) : base(static_cast<char const *>(data)) {}
+
+  // Checks the header, that the sections are in the file, and that every index in the records
+  // points inside its section, so that the accessors below can be used without any check.
+  static auto validate(void const *data, size_t size, std::string *error) -> bool {
+    if (size < sizeof(Header)) {
+      *error = "file too small";
+      return false;
+    }
+    auto header = static_cast<Header const *>(data);
+    if (std::memcmp(header->magic, magic, sizeof(magic)) != 0) {
+      *error = "not a flat AST file";
+      return false;
+    }
+    if (header->byte_order == swapped_byte_order) {
+      *error = "flat AST written on a host with the other byte order";
+      return false;
+    }
+    if (header->version != format_version || header->section_count != SectionCount ||
+        header->byte_order != byte_order_mark) {
+      *error = "unsupported flat AST version " + std::to_string(header->version);
+      return false;
+    }
+    for (auto const &section : header->sections) {
+      if (section.offset > size || section.size > size - section.offset) {
+        *error = "truncated file";
+        return false;
+      }
+      if (section.offset % 8 != 0) {
+        *error = "misaligned section";
+        return false;
+      }
+    }
+    return Reader(data).validate_indices(error);
+  }
+
+  auto header() const -> Header const & { return *reinterpret_cast<Header const *>(base); }
+
+  auto string_count() const -> uint32_t { return count<uint32_t>(StringOffsets); }
+  auto string(uint32_t id) const -> char const * {
+    if (id == no_index) {
+      return nullptr;
+    }
+    return section<char>(StringData) + section<uint32_t>(StringOffsets)[id];
+  }
+
+  auto decl_count() const -> uint32_t { return count<Decl>(Decls); }
+  auto decl(uint32_t id) const -> Decl const & { return section<Decl>(Decls)[id]; }
+  auto type_count() const -> uint32_t { return count<Type>(Types); }
+  auto type(uint32_t id) const -> Type const & { return section<Type>(Types)[id]; }
+  auto params(Range range) const -> Span<Param> {
+    return {section<Param>(Params) + range.first, range.count};
+  }
+  // Decl, type or string ids depending on the field the range comes from
+  auto refs(Range range) const -> Span<uint32_t> {
+    return {section<uint32_t>(Refs) + range.first, range.count};
+  }
+  auto top_level_decls() const -> Span<uint32_t> { return refs(header().top_level_decls); }
+
+  // Returns the first decl (in the order of the file) with that USR, no_index if none.
+  auto find_decl_by_usr(char const *usr) const -> uint32_t {
+    auto sorted = section<uint32_t>(DeclsByUSR);
+    auto sorted_end = sorted + count<uint32_t>(DeclsByUSR);
+    auto found = std::lower_bound(sorted, sorted_end, usr, [this](uint32_t id, char const *usr) {
+      return std::strcmp(string(decl(id).usr), usr) < 0;
+    });
+    if (found == sorted_end || std::strcmp(string(decl(*found).usr), usr) != 0) {
+      return no_index;
+    }
+    return *found;
+  }
+
+private:
+  char const *base;
+
+  auto validate_indices(std::string *error) const -> bool {
+    auto string_data_size = header().sections[StringData].size;
+    if (string_count() != 0 && section<char>(StringData)[string_data_size - 1] != '\0') {
+      *error = "unterminated string";
+      return false;
+    }
+    for (uint32_t id = 0; id < string_count(); ++id) {
+      if (section<uint32_t>(StringOffsets)[id] >= string_data_size) {
+        *error = "string offset out of bounds";
+        return false;
+      }
+    }
+    auto valid = [](uint32_t index, uint32_t limit) { return index == no_index || index < limit; };
+    // Refs lists of indices below limit
+    auto valid_refs = [this](Range range, uint32_t limit) {
+      if (!valid_range(range, count<uint32_t>(Refs))) {
+        return false;
+      }
+      for (auto const ref : refs(range)) {
+        if (ref >= limit) {
+          return false;
+        }
+      }
+      return true;
+    };
+    auto strings = string_count();
+    auto decls = decl_count();
+    auto types = type_count();
+    auto param_count = count<Param>(Params);
+    for (uint32_t id = 0; id < decls; ++id) {
+      auto const &record = decl(id);
+      if (!valid(record.kind, strings) || !valid(record.usr, strings) ||
+          !valid(record.name, strings) || !valid(record.file, strings) ||
+          !valid(record.related, strings) || !valid(record.detail, strings) ||
+          !valid(record.type, types) || !valid_refs(record.children, decls) ||
+          !valid_range(record.params, param_count) || !valid_refs(record.protocols, strings) ||
+          !valid_refs(record.type_params, strings)) {
+        *error = "decl " + std::to_string(id) + " has an index out of bounds";
+        return false;
+      }
+    }
+    for (uint32_t id = 0; id < types; ++id) {
+      auto const &record = type(id);
+      if (!valid(record.type_class, strings) || !valid(record.name, strings) ||
+          !valid(record.decl_usr, strings) || !valid(record.inner, types) ||
+          !valid_range(record.params, param_count) || !valid_refs(record.protocols, strings) ||
+          !valid_refs(record.type_args, types)) {
+        *error = "type " + std::to_string(id) + " has an index out of bounds";
+        return false;
+      }
+    }
+    for (uint32_t id = 0; id < param_count; ++id) {
+      auto const &record = section<Param>(Params)[id];
+      if (!valid(record.name, strings) || !valid(record.type, types)) {
+        *error = "param " + std::to_string(id) + " has an index out of bounds";
+        return false;
+      }
+    }
+    if (!valid_refs(header().top_level_decls, decls)) {
+      *error = "top-level decls out of bounds";
+      return false;
+    }
+    // find_decl_by_usr compares the USRs of these decls
+    for (uint32_t i = 0; i < count<uint32_t>(DeclsByUSR); ++i) {
+      auto id = section<uint32_t>(DeclsByUSR)[i];
+      if (id >= decls || decl(id).usr == no_index) {
+        *error = "decl by USR out of bounds";
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static auto valid_range(Range range, uint32_t size) -> bool {
+    return range.first <= size && range.count <= size - range.first;
+  }
+
+  template <class T> auto section(Section section) const -> T const * {
+    return reinterpret_cast<T const *>(base + header().sections[section].offset);
+  }
+  template <class T> auto count(Section section) const -> uint32_t {
+    return static_cast<uint32_t>(header().sections[section].size / sizeof(T));
+  }
+};
+
+// Read-only memory mapping of a whole file.
+class MappedFile {
+public:
+  MappedFile() = default;
+  MappedFile(MappedFile const &) = delete;
+  auto operator=(MappedFile const &) -> MappedFile & = delete;
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(data_, size_);
+    }
+  }
+
+  auto open(char const *path, std::string *error) -> bool {
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      *error = std::string("could not open ") + path + ": " + std::strerror(errno);
+      return false;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+      *error = std::string("could not get the size of ") + path;
+      ::close(fd);
+      return false;
+    }
+    auto mapped = mmap(nullptr, file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      *error = std::string("could not map ") + path + ": " + std::strerror(errno);
+      return false;
+    }
+    data_ = mapped;
+    size_ = static_cast<size_t>(file_stat.st_size);
+    return true;
+  }
+
+  auto data() const -> void const * { return data_; }
+  auto size() const -> size_t { return size_; }
+
+private:
+  void *data_ = nullptr;
+  size_t size_ = 0;
+};
+
+} // namespace flat_ast
+
+#endif
@@ -0,0 +1,99 @@
+// Front-coded string table, as written by json_serializer --string-table.
+//
+// The strings are sorted and each one is stored as the length in bytes of the prefix it shares with
+// the previous string, followed by the rest of the string (the suffix). Sorted, the USRs of the
+// members of a class, the selectors with the same first keywords or the paths in the same directory
+// follow each other, so most of them are reduced to a short suffix. As the ids were given before
+// the table was complete (in the order the strings were first seen), the table also stores the
+// position in the sorted strings of each id.
+//
+// Every block_size strings the prefix length is forced to 0 (a restart point), so any string can be
+// decoded from the start of its block instead of from the start of the table.
+//
+// In the serializer output, the table is a "string_table" object at the end of the translation
+// unit:
+//   block_size      number of strings per block
+//   keys            keys whose string values (or array of string values) were replaced by ids
+//   positions       for each id, the position of its string in the sorted strings
+//   prefix_lengths  one number per string, in sorted order
+//   suffixes        one string per string, in sorted order
+//
+// This header has no dependency other than the C++14 standard library.
+#ifndef CHOCOLATIER_STRING_TABLE_HPP
+#define CHOCOLATIER_STRING_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace string_table {
+
+constexpr uint32_t default_block_size = 16;
+
+// Length of the prefix shared by both strings, shortened if needed so that it does not end in the
+// middle of an UTF-8 sequence (the suffix must stay valid UTF-8 to be written in JSON).
+inline auto shared_prefix_length(char const *previous, size_t previous_size, char const *current,
+                                 size_t current_size) -> uint32_t {
+  size_t length = 0;
+  size_t max_length = previous_size < current_size ? previous_size : current_size;
+  while (length < max_length && previous[length] == current[length]) {
+    ++length;
+  }
+  while (length > 0 && length < current_size &&
+         (static_cast<unsigned char>(current[length]) & 0xC0) == 0x80) {
+    --length;
+  }
+  return static_cast<uint32_t>(length);
+}
+
+class Decoder {
+public:
+  Decoder(uint32_t block_size, std::vector<uint32_t> positions,
+          std::vector<uint32_t> prefix_lengths, std::vector<std::string> suffixes)
+      : block_size(block_size), positions(std::move(positions)),
+        prefix_lengths(std::move(prefix_lengths)), suffixes(std::move(suffixes)) {}
+
+  auto size() const -> uint32_t { return static_cast<uint32_t>(suffixes.size()); }
+
+  // Decodes a single string, from the restart point of its block.
+  auto get(uint32_t id) const -> std::string {
+    auto position = positions[id];
+    std::string decoded;
+    for (uint32_t i = position - position % block_size; i <= position; ++i) {
+      decoded.resize(prefix_lengths[i]);
+      decoded += suffixes[i];
+    }
+    return decoded;
+  }
+
+  // All the strings, by id.
+  auto decode_all() const -> std::vector<std::string> {
+    std::vector<std::string> sorted_strings;
+    sorted_strings.reserve(suffixes.size());
+    for (uint32_t i = 0; i < suffixes.size(); ++i) {
+      if (prefix_lengths[i] == 0) {
+        sorted_strings.push_back(suffixes[i]);
+      } else {
+        sorted_strings.push_back(sorted_strings.back().substr(0, prefix_lengths[i]) + suffixes[i]);
+      }
+    }
+    std::vector<std::string> strings;
+    strings.reserve(positions.size());
+    for (auto const position : positions) {
+      strings.push_back(sorted_strings[position]);
+    }
+    return strings;
+  }
+
+private:
+  uint32_t block_size;
+  std::vector<uint32_t> positions;
+  std::vector<uint32_t> prefix_lengths;
+  std::vector<std::string> suffixes;
+};
+
+} // namespace string_table
+
+#endif
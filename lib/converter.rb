@@ -4,20 +4,44 @@ require "set"
 class Converter
   def initialize(json)
     @json = json
+    # With --semantic-tags the serializer already recognized the special types
+    @semantic_tags = json[:semantic_tags]
     @declarations = {}
+    @file_modules = {}
   end
 
-  def find_decl(usr)
-    decl = @declarations[usr]
+  def find_decl(key)
+    decl = @declarations[key]
     return decl if decl
+    usr = key.is_a?(Integer) && @json[:usrs] ? @json[:usrs][key] : key
     raise "Could not find declaration #{usr}"
   end
 
+  # When the serializer is run with --decl-ids, decls and references to them
+  # use numeric ids instead of USRs. The converter doesn't care which one it
+  # gets, it only uses them as keys.
+  def decl_key(decl)
+    decl.fetch(:id) { decl[:usr] }
+  end
+
+  def referenced_decl_key(type)
+    type.fetch(:decl_id) { type[:decl_usr] }
+  end
+
+  def interface_key(type)
+    type.fetch(:interface_id) { type[:interface_usr] }
+  end
+
+  def super_class_key(decl)
+    decl.fetch(:super_class_id) { decl[:super_class_usr] }
+  end
+
   def void_type?(type)
     type[:type_class] == "Builtin" && type[:name] == "Void"
   end
 
   def ptr_to_objc_id?(type)
+    return type[:semantic] == "objc_id" if @semantic_tags
     match?(type, {
       type_class: "ObjCObjectPointer",
       pointee: {
@@ -31,6 +55,7 @@ class Converter
   end
 
   def ptr_to_objc_sel?(type)
+    return type[:semantic] == "objc_sel" if @semantic_tags
     match?(type, {
       type_class: "Pointer",
       pointee: {
@@ -41,6 +66,7 @@ class Converter
   end
 
   def ptr_to_objc_class?(type)
+    return type[:semantic] == "objc_class" if @semantic_tags
     match?(type, {
       type_class: "ObjCObjectPointer",
       pointee: {
@@ -53,6 +79,24 @@ class Converter
     })
   end
 
+  # The special meaning of the runtime typedefs, the same tags as the serializer
+  # writes with --semantic-tags.
+  def typedef_semantic(type)
+    return type[:semantic] if @semantic_tags
+    decl = find_decl(referenced_decl_key(type))
+    if type[:name] == "BOOL" && decl[:type][:type_class] == "Builtin" && %w[SChar Bool].include?(decl[:type][:name])
+      "objc_bool"
+    elsif type[:name] == "instancetype" && ptr_to_objc_id?(decl[:type])
+      "instancetype"
+    elsif type[:name] == "id" && ptr_to_objc_id?(decl[:type])
+      "objc_id"
+    elsif type[:name] == "SEL" && ptr_to_objc_sel?(decl[:type])
+      "objc_sel"
+    elsif type[:name] == "Class" && ptr_to_objc_class?(decl[:type])
+      "objc_class"
+    end
+  end
+
   def match?(json, pattern)
     case pattern
     when Array
@@ -106,16 +150,16 @@ class Converter
         raise "Unknown builtin type #{type.inspect}"
       end
     when "Typedef"
-      decl = find_decl(type[:decl_usr])
-      if type[:name] == "BOOL" && decl[:type][:type_class] == "Builtin" && decl[:type][:name] = "SChar"
+      case typedef_semantic(type)
+      when "objc_bool"
         "bool"
-      elsif type[:name] == "instancetype" && ptr_to_objc_id?(decl[:type])
+      when "instancetype"
         "Self"
-      elsif type[:name] == "id" && ptr_to_objc_id?(decl[:type])
+      when "objc_id"
         "ObjCObjectPointer"
-      elsif type[:name] == "SEL" && ptr_to_objc_sel?(decl[:type])
+      when "objc_sel"
         "objc::runtime::Sel"
-      elsif type[:name] == "Class" && ptr_to_objc_class?(decl[:type])
+      when "objc_class"
         "Class"
       else
         type[:name]
@@ -124,9 +168,7 @@ class Converter
       if ptr_to_objc_id?(type)
         "ObjCObjectPointer"
       else
-        pointee = type[:pointee]
-        decl = find_decl(pointee[:interface_usr])
-        decl[:name]
+        type.fetch(:canonical_class) { find_decl(interface_key(type[:pointee]))[:name] }
       end
     when "ObjCTypeParam"
       type[:name]
@@ -137,8 +179,19 @@ class Converter
   end
 
   def determine_module(decl)
+    # Written by the serializer with --modules
+    return decl[:module] if decl[:module]
     return "core" if decl[:is_implicit] && !decl[:location]
-    file_path = decl[:location][:file]
+    location = decl[:location]
+    # Decls come from a few files so classify each file only once
+    if file_id = location[:file_id]
+      @file_modules[file_id] ||= file_module(@json[:files][file_id])
+    else
+      @file_modules[location[:file]] ||= file_module(location[:file])
+    end
+  end
+
+  def file_module(file_path)
     mod = case file_path
     when %r{/System/Library/Frameworks/([^./]+)\.framework/Headers/[^/.]+\.h\z}
       $1
@@ -196,16 +249,14 @@ class Converter
         raise "Unknown builtin type #{type.inspect}"
       end
     when "Typedef"
-      decl = find_decl(type[:decl_usr])
-      if type[:name] == "BOOL" && decl[:type][:type_class] == "Builtin" && decl[:type][:name] = "SChar"
+      case typedef_semantic(type)
+      when "objc_bool"
         "objc::runtime::BOOL" # TODO: Should use our own typedef (should not need special treatment here (even though special treatment will be needed for conversion to and from bool)
-      elsif type[:name] == "instancetype" && ptr_to_objc_id?(decl[:type])
-        "ObjCObjectPointer"
-      elsif type[:name] == "id" && ptr_to_objc_id?(decl[:type])
+      when "instancetype", "objc_id"
         "ObjCObjectPointer"
-      elsif type[:name] == "SEL" && ptr_to_objc_sel?(decl[:type])
+      when "objc_sel"
         "objc::runtime::Sel"
-      elsif type[:name] == "Class" && ptr_to_objc_class?(decl[:type])
+      when "objc_class"
         "Class"
       else
         type[:name]
@@ -219,8 +270,7 @@ class Converter
     when "ElaboratedType"
       rustify_raw_type(type[:named_type])
     when "Record"
-      decl_usr = type[:decl_usr]
-      record_name(find_decl(decl_usr))
+      record_name(find_decl(referenced_decl_key(type)))
     when "Pointer", "Decayed"
       "*#{rustify_raw_type(type[:pointee])}"
     when "Paren"
@@ -314,7 +364,7 @@ class Converter
     when "Builtin"
       true
     when "Typedef"
-      decl = find_decl(type[:decl_usr])
+      decl = find_decl(referenced_decl_key(type))
       type_handled?(decl[:type])
     when "ObjCObjectPointer",
       true
@@ -339,7 +389,7 @@ class Converter
   end
 
   def add_objc_defs_used_by_decl(decl)
-    usr = decl[:usr]
+    usr = decl_key(decl)
     return if definition_used?(usr)
     case decl[:kind]
     when "ObjCInterface", "ObjCProtocol", "ObjCCategory"
@@ -395,7 +445,7 @@ class Converter
     when "Builtin", "ObjCTypeParam"
       nil
     when "Typedef", "Record", "Enum"
-      decl = find_decl(type[:decl_usr])
+      decl = find_decl(referenced_decl_key(type))
       add_objc_defs_used_by_decl(decl)
     when "Attributed"
       add_objc_defs_used_by_type(type[:modified_type])
@@ -405,10 +455,10 @@ class Converter
       if type[:base_type]
         add_objc_defs_used_by_type(type[:base_type])
       else
-        decl = find_decl(type[:interface_usr])
+        decl = find_decl(interface_key(type))
         add_objc_defs_used_by_decl(decl)
-        if decl[:super_class_usr]
-          super_class_decl = find_decl(decl[:super_class_usr])
+        if super_class = super_class_key(decl)
+          super_class_decl = find_decl(super_class)
           add_objc_defs_used_by_decl(super_class_decl)
         end
       end
@@ -443,7 +493,7 @@ class Converter
   end
 
   def record_name(decl)
-    record_usr = decl[:usr]
+    record_usr = decl_key(decl)
     if typedef_usr = @elaborated_types_named_by_typedefs[record_usr]
       typedef_decl = find_decl(typedef_usr)
       typedef_decl[:name]
@@ -459,7 +509,7 @@ class Converter
 
     # A full declaration might come after its first use so make the list of all declarations first.
     @json[:children].each do |decl|
-      usr = decl[:usr]
+      usr = decl_key(decl)
       known_decl = @declarations[usr]
       if known_decl
         next if decl[:is_forward_declaration]
@@ -467,7 +517,7 @@ class Converter
         next if decl[:kind] == "Typedef" && decl[:type] == known_decl[:type]
 
 next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
-        raise "Multiple definitions of #{decl[:usr]}: #{decl.inspect} and #{@declarations[decl[:usr]].inspect}" unless known_decl[:is_forward_declaration]
+        raise "Multiple definitions of #{usr}: #{decl.inspect} and #{known_decl.inspect}" unless known_decl[:is_forward_declaration]
       end
 
       @declarations[usr] = decl
@@ -504,7 +554,7 @@ next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
     @elaborated_types_named_by_typedefs = {}
     @json[:children].each do |decl|
       next if decl[:is_forward_declaration]
-      next unless definition_used?(decl[:usr])
+      next unless definition_used?(decl_key(decl))
 
       mod = determine_module(decl)
 
@@ -524,10 +574,10 @@ next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
         end
       when "Typedef"
         if %w{Record Enum}.include?(decl[:type][:type_class])
-          elaborated_type_usr = decl[:type][:decl_usr]
+          elaborated_type_usr = referenced_decl_key(decl[:type])
           elaborated_type = find_decl(elaborated_type_usr)
           if decl[:name].gsub("_", "").downcase == elaborated_type[:name].gsub("_", "").downcase
-            @elaborated_types_named_by_typedefs[elaborated_type_usr] = decl[:usr]
+            @elaborated_types_named_by_typedefs[elaborated_type_usr] = decl_key(decl)
           end
         end
       end
@@ -610,8 +660,8 @@ next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
           puts "    }"
 
           base_traits = ["Raw#{name}Interface"]
-          if decl[:super_class_usr]
-            super_class_decl = find_decl(decl[:super_class_usr])
+          if super_class = super_class_key(decl)
+            super_class_decl = find_decl(super_class)
             base_traits << "#{super_class_decl[:name]}Interface"
           end
           base_traits.concat(followed_protocols.map {|protocol| protocol_trait_name(protocol, when_in: mod) })
@@ -662,7 +712,7 @@ next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
 
           categories_on_same_class = @categories_per_module[mod][class_name]
           # We regroup all categories on the same class at the place the last category was defined in the module
-          next unless categories_on_same_class.last[:usr] == decl[:usr]
+          next unless decl_key(categories_on_same_class.last) == decl_key(decl)
 
           methods = categories_on_same_class.map do |category_decl|
             category_decl[:children].select {|child| child[:kind] == "ObjCMethod" }
@@ -690,18 +740,18 @@ next if decl[:kind] == "Function" || decl[:kind] == "Var" # TODO
           puts "    impl #{class_name}Category for #{class_mod}::#{class_name} {}"
 
         when "Record"
-          next if @elaborated_types_named_by_typedefs[decl[:usr]]
+          next if @elaborated_types_named_by_typedefs[decl_key(decl)]
           rustify_record(decl)
 
         when "Enum"
-          next if @elaborated_types_named_by_typedefs[decl[:usr]]
+          next if @elaborated_types_named_by_typedefs[decl_key(decl)]
           # TODO
 
         when "Typedef"
           case decl[:type][:type_class]
           when "Record"
-            record_usr = decl[:type][:decl_usr]
-            if @elaborated_types_named_by_typedefs[record_usr] == decl[:usr]
+            record_usr = referenced_decl_key(decl[:type])
+            if @elaborated_types_named_by_typedefs[record_usr] == decl_key(decl)
               rustify_record(find_decl(record_usr))
             else
               # TODO
@@ -4,6 +4,8 @@ module JSONSerializer
   BASE_DIR = Pathname.new(__dir__).join("..").expand_path
   BINARY_PATH = BASE_DIR.join("bin", "json_serializer")
   SOURCE_PATH = BASE_DIR.join("src", "json_serializer.cpp")
+  # The binary has to be rebuilt when any of the files it includes changes
+  SOURCE_DEPENDENCIES = Pathname.glob(BASE_DIR.join("src", "*.{cpp,hpp}")) + Pathname.glob(BASE_DIR.join("include", "*.hpp"))
 end
 
 require_relative "./json_serializer/builder.rb"
@@ -60,7 +60,7 @@ module JSONSerializer
 
     def self.up_to_date?
       return false unless serializer_available?
-      SOURCE_PATH.mtime <= BINARY_PATH.mtime
+      SOURCE_DEPENDENCIES.map(&:mtime).max <= BINARY_PATH.mtime
     end
 
     def self.build
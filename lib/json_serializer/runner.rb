@@ -2,6 +2,7 @@ require_relative "../json_serializer"
 
 require "shellwords"
 require "json"
+require "set"
 
 module AppleSDK
   def self.sdk_name(sdk)
@@ -34,11 +35,161 @@ end
 
 module JSONSerializer
   module Runner
-    def self.run_on_objc_file(file_path)
+    # MessagePack is much faster to parse than JSON so use it when the gem is available.
+    def self.default_format
+      require "msgpack"
+      :msgpack
+    rescue LoadError
+      :json
+    end
+
+    def self.command_line(file_path, serializer_options)
       sdk_path = AppleSDK.sdk_path(:mac_os)
-      output = `#{BINARY_PATH.to_s.shellescape} #{file_path.to_s.shellescape} -- -x objective-c -isysroot #{sdk_path.to_s.shellescape} -fobjc-arc`
+      command = [BINARY_PATH, *serializer_options, file_path, "--", "-x", "objective-c", "-isysroot", sdk_path, "-fobjc-arc"]
+      command.map {|arg| arg.to_s.shellescape }.join(" ")
+    end
+
+    # The keys of the decls Converter reads, the serializer skips everything else
+    CONVERTER_FIELDS = %w[
+      name usr location is_implicit is_forward_declaration type return_type params.name params.type
+      is_instance_method selector tag_kind protocols class_name super_class_usr integer_type
+    ].freeze
+
+    # Serializer modes Converter understands. All off by default so that the serializer runs as it
+    # always did, each one can be enabled and evaluated on its own.
+    OUTPUT_MODES = {
+      intern_types: "--intern-types",
+      decl_ids: "--decl-ids",
+      file_ids: "--file-ids",
+      string_table: "--string-table",
+      # Converter only uses one declaration of each decl, the definition when there is one
+      dedup: "--dedup",
+      modules: "--modules",
+      semantic_tags: "--semantic-tags",
+    }.freeze
+
+    # frameworks: only keep the top-level decls from the headers of these frameworks, and of the
+    #   runtime and system headers they all need
+    # reachable_only: only keep the decls the Objective-C API uses. Off by default: the native
+    #   closure is not yet checked to match Converter#add_objc_defs_used_by_decl.
+    # modes: the OUTPUT_MODES to enable, for example intern_types: true
+    def self.run_on_objc_file(file_path, format: default_format, fields: CONVERTER_FIELDS, frameworks: nil, reachable_only: false, **modes)
+      unknown_modes = modes.keys - OUTPUT_MODES.keys
+      raise "Unknown serializer modes #{unknown_modes.join(", ")}" unless unknown_modes.empty?
+      # Nobody reads the output directly so no need for indentation
+      serializer_options = ["--compact", "--format=#{format}"]
+      OUTPUT_MODES.each {|mode, option| serializer_options << option if modes[mode] }
+      serializer_options << "--fields=#{fields.join(",")}" if fields
+      serializer_options << "--frameworks=#{frameworks.join(",")}" if frameworks
+      serializer_options << "--reachable-only" if reachable_only
+      output = `#{command_line(file_path, serializer_options)}`
       raise "Error parsing #{file_path}: #{output}" unless $?.success?
-      JSON.parse(output.strip, symbolize_names: true)
+      expand_types(expand_strings(decode(output, format)))
+    end
+
+    # Yields the top-level declarations one by one while the serializer is still
+    # running, so the whole translation unit never has to be in memory.
+    # The tables only come at the end of the output so none is used.
+    def self.each_top_level_decl_in_objc_file(file_path)
+      IO.popen(command_line(file_path, ["--jsonl"])) do |io|
+        header = io.gets
+        raise "Error parsing #{file_path}" if header.nil?
+        io.each_line do |line|
+          yield JSON.parse(line, symbolize_names: true)
+        end
+      end
+      raise "Error parsing #{file_path}" unless $?.success?
+    end
+
+    def self.decode(output, format)
+      case format.to_sym
+      when :json
+        JSON.parse(output.strip, symbolize_names: true)
+      when :msgpack
+        require "msgpack"
+        MessagePack.unpack(output, symbolize_keys: true)
+      when :cbor
+        require "cbor"
+        symbolize_keys(CBOR.decode(output))
+      else
+        raise "Unknown serializer output format #{format}"
+      end
+    end
+
+    # With --string-table the values of some keys are ids in a table where the
+    # strings are sorted and each one is stored as the length of the prefix it
+    # shares with the previous one, followed by the rest of the string, and
+    # where positions gives the place of each id (see include/string_table.hpp).
+    def self.expand_strings(tu)
+      table = tu.delete(:string_table)
+      return tu if table.nil?
+      sorted_strings = []
+      table[:suffixes].each_with_index do |suffix, i|
+        prefix_length = table[:prefix_lengths][i]
+        sorted_strings << (prefix_length == 0 ? suffix : sorted_strings.last.byteslice(0, prefix_length) + suffix)
+      end
+      strings = table[:positions].map {|position| sorted_strings.fetch(position) }
+      keys = Set.new(table[:keys].map(&:to_sym))
+      resolve_string_ids(tu, strings, keys)
+      tu
+    end
+
+    def self.resolve_string_ids(value, strings, keys)
+      case value
+      when Hash
+        value.each do |key, child|
+          if !keys.include?(key)
+            resolve_string_ids(child, strings, keys)
+          elsif child.is_a?(Array)
+            value[key] = child.map {|id| strings.fetch(id) }
+          else
+            value[key] = strings.fetch(child)
+          end
+        end
+      when Array
+        value.each {|child| resolve_string_ids(child, strings, keys) }
+      end
+    end
+
+    TYPE_KEYS = %i[type return_type integer_type pointee element_type inner_type named_type modified_type base_type].freeze
+
+    # With --intern-types the types are written once in a table and referenced by index.
+    # Replace the indices by the types so that the rest of the code does not have to know.
+    # Types used in several places end up shared, so they must not be modified.
+    def self.expand_types(tu)
+      types = tu.delete(:types)
+      return tu if types.nil?
+      types.each {|type| resolve_type_ids(type, types) }
+      resolve_type_ids(tu, types)
+      tu
+    end
+
+    def self.resolve_type_ids(value, types)
+      case value
+      when Hash
+        value.each do |key, child|
+          if TYPE_KEYS.include?(key) && child.is_a?(Integer)
+            value[key] = types.fetch(child)
+          elsif key == :type_args
+            value[key] = child.map {|id| types.fetch(id) }
+          else
+            resolve_type_ids(child, types)
+          end
+        end
+      when Array
+        value.each {|child| resolve_type_ids(child, types) }
+      end
+    end
+
+    def self.symbolize_keys(value)
+      case value
+      when Hash
+        value.each_with_object({}) {|(key, child), hash| hash[key.to_sym] = symbolize_keys(child) }
+      when Array
+        value.map {|child| symbolize_keys(child) }
+      else
+        value
+      end
     end
   end
 end
@@ -0,0 +1,83 @@
+#ifndef CHOCOLATIER_BACKGROUND_WRITER_HPP
+#define CHOCOLATIER_BACKGROUND_WRITER_HPP
+
+#include "llvm/Support/raw_ostream.h"
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+
+// Writes chunks of output on a dedicated thread so that the I/O overlaps with the parsing and
+// serialization. The queue is bounded: when the output cannot keep up, push() blocks instead of
+// letting the pending chunks grow without limit.
+class BackgroundWriter {
+public:
+  BackgroundWriter(llvm::raw_ostream &out, size_t max_queued_chunks)
+      : out(out), max_queued_chunks(max_queued_chunks), thread([this] { run(); }) {}
+  BackgroundWriter(BackgroundWriter const &) = delete;
+  auto operator=(BackgroundWriter const &) -> BackgroundWriter & = delete;
+  ~BackgroundWriter() { finish(); }
+
+  auto push(std::string chunk) -> void {
+    std::unique_lock<std::mutex> lock{mutex};
+    not_full.wait(lock, [this] { return chunks.size() < max_queued_chunks; });
+    chunks.push_back(std::move(chunk));
+    not_empty.notify_one();
+  }
+
+  // Waits for all the queued chunks to be written, and flushes the output.
+  auto finish() -> void {
+    if (!thread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      finished = true;
+      not_empty.notify_one();
+    }
+    thread.join();
+    out.flush();
+  }
+
+  // Drops the chunks not written yet and stops, for an output that must not be completed.
+  auto discard() -> void {
+    {
+      std::lock_guard<std::mutex> lock{mutex};
+      chunks.clear();
+      not_full.notify_all();
+    }
+    finish();
+  }
+
+private:
+  llvm::raw_ostream &out;
+  size_t max_queued_chunks;
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+  std::deque<std::string> chunks;
+  bool finished = false;
+  // Must stay the last member so that everything it uses is initialized before it starts.
+  std::thread thread;
+
+  auto run() -> void {
+    for (;;) {
+      std::string chunk;
+      {
+        std::unique_lock<std::mutex> lock{mutex};
+        not_empty.wait(lock, [this] { return finished || !chunks.empty(); });
+        if (chunks.empty()) {
+          return;
+        }
+        chunk = std::move(chunks.front());
+        chunks.pop_front();
+        not_full.notify_one();
+      }
+      out << chunk;
+    }
+  }
+};
+
+#endif
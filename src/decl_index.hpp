@@ -0,0 +1,144 @@
+#ifndef CHOCOLATIER_DECL_INDEX_HPP
+#define CHOCOLATIER_DECL_INDEX_HPP
+
+#include "json_writer.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+// Index written next to the output (by -index) to find where each decl is without parsing the
+// whole output. It is a text file with one entry per line, first the USRs then the names (the
+// selector for methods), each group sorted by key:
+//   usr<TAB>key<TAB>offset<TAB>length
+//   name<TAB>key<TAB>offset<TAB>length
+// offset and length are in bytes and delimit the JSON object of the decl in the output.
+class DeclIndexBuilder {
+public:
+  explicit DeclIndexBuilder(JSONTextWriter const &text_writer) : text_writer(text_writer) {}
+
+  // To call just after starting the object of a decl, the result must be given to add().
+  auto decl_started() const -> uint64_t { return text_writer.last_container_start(); }
+
+  // To call just after ending the object of a decl.
+  auto add(llvm::StringRef usr, llvm::StringRef name, uint64_t start_offset) -> void {
+    auto length = text_writer.last_container_end() - start_offset;
+    if (!usr.empty()) {
+      by_usr.push_back(Entry{usr.str(), start_offset, length});
+    }
+    if (!name.empty()) {
+      by_name.push_back(Entry{name.str(), start_offset, length});
+    }
+  }
+
+  auto write(llvm::raw_ostream &out) -> void {
+    write_entries(out, "usr", by_usr);
+    write_entries(out, "name", by_name);
+  }
+
+private:
+  struct Entry {
+    std::string key;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  JSONTextWriter const &text_writer;
+  std::vector<Entry> by_usr;
+  std::vector<Entry> by_name;
+
+  static auto write_entries(llvm::raw_ostream &out, llvm::StringRef kind,
+                            std::vector<Entry> &entries) -> void {
+    // Stable so that entries with the same key stay in the order of the output
+    std::stable_sort(entries.begin(), entries.end(),
+                     [](Entry const &a, Entry const &b) { return a.key < b.key; });
+    for (auto const &entry : entries) {
+      out << kind << '\t' << entry.key << '\t' << entry.offset << '\t' << entry.length << '\n';
+    }
+  }
+};
+
+class DeclIndexReader {
+public:
+  struct Entry {
+    llvm::StringRef key;
+    uint64_t offset;
+    uint64_t length;
+  };
+
+  // Returns false if the index is not well formed.
+  auto load(std::unique_ptr<llvm::MemoryBuffer> index_buffer) -> bool {
+    buffer = std::move(index_buffer);
+    llvm::StringRef remaining = buffer->getBuffer();
+    while (!remaining.empty()) {
+      llvm::StringRef line;
+      std::tie(line, remaining) = remaining.split('\n');
+      llvm::SmallVector<llvm::StringRef, 4> fields;
+      line.split(fields, '\t');
+      Entry entry;
+      if (fields.size() != 4 || fields[2].getAsInteger(10, entry.offset) ||
+          fields[3].getAsInteger(10, entry.length)) {
+        return false;
+      }
+      entry.key = fields[1];
+      if (fields[0] == "usr") {
+        by_usr.push_back(entry);
+      } else if (fields[0] == "name") {
+        by_name.push_back(entry);
+      } else {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  auto find_usr(llvm::StringRef usr) const -> llvm::ArrayRef<Entry> {
+    return equal_range(by_usr, usr);
+  }
+  auto find_name(llvm::StringRef name) const -> llvm::ArrayRef<Entry> {
+    return equal_range(by_name, name);
+  }
+  // Names (or selectors) starting with the prefix
+  auto find_name_prefix(llvm::StringRef prefix) const -> llvm::ArrayRef<Entry> {
+    auto first = lower_bound(by_name, prefix);
+    auto last = std::find_if(first, by_name.end(), [prefix](Entry const &entry) {
+      return !entry.key.startswith(prefix);
+    });
+    return slice(by_name, first, last);
+  }
+
+private:
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  std::vector<Entry> by_usr;
+  std::vector<Entry> by_name;
+
+  static auto lower_bound(std::vector<Entry> const &entries, llvm::StringRef key)
+      -> std::vector<Entry>::const_iterator {
+    return std::lower_bound(
+        entries.begin(), entries.end(), key,
+        [](Entry const &entry, llvm::StringRef searched) { return entry.key < searched; });
+  }
+
+  static auto equal_range(std::vector<Entry> const &entries, llvm::StringRef key)
+      -> llvm::ArrayRef<Entry> {
+    auto first = lower_bound(entries, key);
+    auto last = std::find_if(first, entries.end(),
+                             [key](Entry const &entry) { return entry.key != key; });
+    return slice(entries, first, last);
+  }
+
+  static auto slice(std::vector<Entry> const &entries, std::vector<Entry>::const_iterator first,
+                    std::vector<Entry>::const_iterator last) -> llvm::ArrayRef<Entry> {
+    return llvm::makeArrayRef(entries.data() + (first - entries.begin()), last - first);
+  }
+};
+
+#endif
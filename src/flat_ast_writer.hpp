@@ -0,0 +1,431 @@
+#ifndef CHOCOLATIER_FLAT_AST_WRITER_HPP
+#define CHOCOLATIER_FLAT_AST_WRITER_HPP
+
+#include "flat_ast.hpp"
+#include "json_writer.hpp"
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSwitch.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+// Builds the flat binary AST (see flat_ast.hpp) from the events of the serializer. The records are
+// filled in place while the events come, so no intermediate document is needed; only the compact
+// records and the deduplicated strings are kept until write() is called.
+//
+// The types must be interned: uses of a type are indices in the "types" table at the end of the
+// translation unit, and entry i of that table becomes the type record i.
+class FlatASTWriter : public JSONWriter {
+public:
+  virtual auto start_object() -> void override {
+    if (stack.empty()) {
+      stack.push_back(Frame{FrameKind::TranslationUnit});
+      return;
+    }
+    auto &parent = stack.back();
+    switch (parent.kind) {
+    case FrameKind::DeclArray:
+      parent.items.push_back(static_cast<uint32_t>(decls.size()));
+      stack.push_back(Frame{FrameKind::Decl, new_decl()});
+      return;
+    case FrameKind::TypeTable:
+      stack.push_back(Frame{FrameKind::Type, new_type()});
+      return;
+    case FrameKind::ParamArray:
+      parent.params.push_back(flat_ast::Param{flat_ast::no_index, flat_ast::no_index, 0});
+      stack.push_back(Frame{FrameKind::Param, static_cast<uint32_t>(parent.params.size() - 1)});
+      return;
+    case FrameKind::Decl:
+      if (current_key == "location") {
+        stack.push_back(Frame{FrameKind::Location, parent.index});
+      } else if (current_key == "attrs") {
+        stack.push_back(Frame{FrameKind::DeclAttrs, parent.index});
+      } else {
+        stack.push_back(Frame{FrameKind::Ignored});
+      }
+      return;
+    case FrameKind::Param:
+      if (current_key == "attrs") {
+        stack.push_back(Frame{FrameKind::ParamAttrs, parent.index});
+      } else {
+        stack.push_back(Frame{FrameKind::Ignored});
+      }
+      return;
+    default:
+      stack.push_back(Frame{FrameKind::Ignored});
+      return;
+    }
+  }
+
+  virtual auto end_object() -> void override { stack.pop_back(); }
+
+  virtual auto start_array() -> void override {
+    auto parent_kind = stack.back().kind;
+    auto kind = FrameKind::Ignored;
+    if (parent_kind == FrameKind::TranslationUnit) {
+      kind = llvm::StringSwitch<FrameKind>(current_key)
+                 .Case("children", FrameKind::DeclArray)
+                 .Case("types", FrameKind::TypeTable)
+                 .Default(FrameKind::Ignored);
+    } else if (parent_kind == FrameKind::Decl) {
+      kind = llvm::StringSwitch<FrameKind>(current_key)
+                 .Cases("children", "fields", "enumerators", FrameKind::DeclArray)
+                 .Case("params", FrameKind::ParamArray)
+                 .Cases("protocols", "type_params", FrameKind::StringArray)
+                 .Default(FrameKind::Ignored);
+    } else if (parent_kind == FrameKind::Type) {
+      kind = llvm::StringSwitch<FrameKind>(current_key)
+                 .Case("params", FrameKind::ParamArray)
+                 .Case("protocols", FrameKind::StringArray)
+                 .Case("type_args", FrameKind::TypeArray)
+                 .Default(FrameKind::Ignored);
+    }
+    Frame frame{kind};
+    frame.key.assign(current_key.begin(), current_key.end());
+    stack.push_back(std::move(frame));
+  }
+
+  virtual auto end_array() -> void override {
+    auto frame = std::move(stack.back());
+    stack.pop_back();
+    flat_ast::Range range{0, 0};
+    switch (frame.kind) {
+    case FrameKind::DeclArray:
+    case FrameKind::TypeArray:
+    case FrameKind::StringArray:
+      range.first = static_cast<uint32_t>(refs.size());
+      range.count = static_cast<uint32_t>(frame.items.size());
+      refs.insert(refs.end(), frame.items.begin(), frame.items.end());
+      break;
+    case FrameKind::ParamArray:
+      range.first = static_cast<uint32_t>(params.size());
+      range.count = static_cast<uint32_t>(frame.params.size());
+      params.insert(params.end(), frame.params.begin(), frame.params.end());
+      break;
+    default:
+      return;
+    }
+
+    auto &parent = stack.back();
+    switch (parent.kind) {
+    case FrameKind::TranslationUnit:
+      top_level_decls = range;
+      break;
+    case FrameKind::Decl: {
+      auto &decl = decls[parent.index];
+      if (frame.key == "params") {
+        decl.params = range;
+      } else if (frame.key == "protocols") {
+        decl.protocols = range;
+      } else if (frame.key == "type_params") {
+        decl.type_params = range;
+      } else {
+        decl.children = range;
+      }
+    } break;
+    case FrameKind::Type: {
+      auto &type = types[parent.index];
+      if (frame.key == "params") {
+        type.params = range;
+      } else if (frame.key == "protocols") {
+        type.protocols = range;
+      } else {
+        type.type_args = range;
+      }
+    } break;
+    default:
+      break;
+    }
+  }
+
+  virtual auto key(llvm::StringRef key) -> void override { current_key = key; }
+
+  virtual auto string(llvm::StringRef value) -> void override {
+    auto &frame = stack.back();
+    switch (frame.kind) {
+    case FrameKind::Decl: {
+      auto &decl = decls[frame.index];
+      if (current_key == "kind") {
+        decl.kind = string_id(value);
+      } else if (current_key == "usr") {
+        decl.usr = string_id(value);
+      } else if (current_key == "name" || current_key == "selector") {
+        decl.name = string_id(value);
+      } else if (current_key == "class_name" || current_key == "super_class_usr") {
+        decl.related = string_id(value);
+      } else if (current_key == "tag_kind" || current_key == "method_family" ||
+                 current_key == "value") {
+        decl.detail = string_id(value);
+      } else if (current_key == "implementation_control" ||
+                 current_key == "property_implementation") {
+        decl.flags |= value == "optional" ? flat_ast::DeclIsOptional : flat_ast::DeclIsRequired;
+      }
+    } break;
+    case FrameKind::Location:
+      if (current_key == "file") {
+        decls[frame.index].file = string_id(value);
+      }
+      break;
+    case FrameKind::Type: {
+      auto &type = types[frame.index];
+      if (current_key == "type_class") {
+        type.type_class = string_id(value);
+      } else if (current_key == "name" || current_key == "keyword") {
+        type.name = string_id(value);
+      } else if (current_key == "decl_usr" || current_key == "interface_usr") {
+        type.decl_usr = string_id(value);
+      } else if (current_key == "nullability") {
+        type.flags |= value == "nonnull" ? flat_ast::TypeIsNonnull : flat_ast::TypeIsNullable;
+      }
+    } break;
+    case FrameKind::Param:
+      if (current_key == "name") {
+        current_param().name = string_id(value);
+      }
+      break;
+    case FrameKind::StringArray:
+      frame.items.push_back(string_id(value));
+      break;
+    default:
+      break;
+    }
+  }
+
+  virtual auto boolean(bool value) -> void override {
+    if (!value) {
+      return;
+    }
+    auto &frame = stack.back();
+    switch (frame.kind) {
+    case FrameKind::Decl:
+      decls[frame.index].flags |= llvm::StringSwitch<uint32_t>(current_key)
+                                      .Case("is_implicit", flat_ast::DeclIsImplicit)
+                                      .Case("is_referenced", flat_ast::DeclIsReferenced)
+                                      .Case("is_forward_declaration",
+                                            flat_ast::DeclIsForwardDeclaration)
+                                      .Case("is_instance_method", flat_ast::DeclIsInstanceMethod)
+                                      .Case("is_variadic", flat_ast::DeclIsVariadic)
+                                      .Case("is_closed", flat_ast::DeclIsClosed)
+                                      .Case("is_flag", flat_ast::DeclIsFlag)
+                                      .Case("has_body", flat_ast::DeclHasBody)
+                                      .Default(0);
+      break;
+    case FrameKind::DeclAttrs:
+      decls[frame.index].flags |=
+          llvm::StringSwitch<uint32_t>(current_key)
+              .Case("self_is_consumed", flat_ast::DeclSelfIsConsumed)
+              .Case("ns_returns_retained", flat_ast::DeclNSReturnsRetained)
+              .Default(0);
+      break;
+    case FrameKind::Type:
+      types[frame.index].flags |=
+          llvm::StringSwitch<uint32_t>(current_key)
+              .Case("is_variadic", flat_ast::TypeIsVariadic)
+              .Case("ns_returns_retained", flat_ast::TypeNSReturnsRetained)
+              .Default(0);
+      break;
+    case FrameKind::Param:
+    case FrameKind::ParamAttrs:
+      if (current_key == "is_consumed") {
+        current_param().flags |= flat_ast::ParamIsConsumed;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  virtual auto number_unsigned(uint64_t value) -> void override {
+    auto &frame = stack.back();
+    switch (frame.kind) {
+    case FrameKind::Location:
+      if (current_key == "line") {
+        decls[frame.index].line = static_cast<uint32_t>(value);
+      }
+      break;
+    case FrameKind::Decl:
+      if (current_key == "bit_width") {
+        decls[frame.index].bit_width = static_cast<uint32_t>(value);
+        decls[frame.index].flags |= flat_ast::DeclHasBitWidth;
+      } else if (current_key == "type" || current_key == "return_type" ||
+                 current_key == "integer_type") {
+        decls[frame.index].type = static_cast<uint32_t>(value);
+      }
+      break;
+    case FrameKind::Type:
+      if (current_key == "size" || current_key == "num_elements") {
+        types[frame.index].size = value;
+      } else if (is_inner_type_key(current_key)) {
+        types[frame.index].inner = static_cast<uint32_t>(value);
+      }
+      break;
+    case FrameKind::Param:
+      if (current_key == "type") {
+        current_param().type = static_cast<uint32_t>(value);
+      }
+      break;
+    case FrameKind::TypeArray:
+      frame.items.push_back(static_cast<uint32_t>(value));
+      break;
+    default:
+      break;
+    }
+  }
+
+  virtual auto null() -> void override {}
+
+  auto write(llvm::raw_ostream &out) -> void {
+    std::vector<uint32_t> decls_by_usr;
+    for (uint32_t id = 0; id < decls.size(); ++id) {
+      if (decls[id].usr != flat_ast::no_index) {
+        decls_by_usr.push_back(id);
+      }
+    }
+    std::stable_sort(decls_by_usr.begin(), decls_by_usr.end(), [this](uint32_t a, uint32_t b) {
+      return std::strcmp(&string_data[string_offsets[decls[a].usr]],
+                         &string_data[string_offsets[decls[b].usr]]) < 0;
+    });
+
+    flat_ast::Header header;
+    std::memset(&header, 0, sizeof(header));
+    std::memcpy(header.magic, flat_ast::magic, sizeof(header.magic));
+    header.version = flat_ast::format_version;
+    header.section_count = flat_ast::SectionCount;
+    header.byte_order = flat_ast::byte_order_mark;
+    header.top_level_decls = top_level_decls;
+
+    SectionData sections[flat_ast::SectionCount];
+    sections[flat_ast::StringOffsets] = bytes_of(string_offsets);
+    sections[flat_ast::StringData] = bytes_of(string_data);
+    sections[flat_ast::Decls] = bytes_of(decls);
+    sections[flat_ast::Types] = bytes_of(types);
+    sections[flat_ast::Params] = bytes_of(params);
+    sections[flat_ast::Refs] = bytes_of(refs);
+    sections[flat_ast::DeclsByUSR] = bytes_of(decls_by_usr);
+
+    uint64_t offset = align(sizeof(header));
+    for (uint32_t i = 0; i < flat_ast::SectionCount; ++i) {
+      header.sections[i].offset = offset;
+      header.sections[i].size = sections[i].size;
+      offset = align(offset + sections[i].size);
+    }
+
+    uint64_t written = 0;
+    auto write_padded = [&](void const *data, uint64_t size) {
+      out.write(static_cast<char const *>(data), size);
+      written += size;
+      static char const padding[8] = {};
+      out.write(padding, align(written) - written);
+      written = align(written);
+    };
+    write_padded(&header, sizeof(header));
+    for (auto const &section : sections) {
+      write_padded(section.data, section.size);
+    }
+  }
+
+private:
+  enum class FrameKind {
+    TranslationUnit,
+    Decl,
+    Location,
+    DeclAttrs,
+    Type,
+    Param,
+    ParamAttrs,
+    DeclArray,
+    TypeArray,
+    TypeTable,
+    ParamArray,
+    StringArray,
+    Ignored,
+  };
+
+  struct Frame {
+    FrameKind kind;
+    // Decl or type id for the record frames, index in the params of the parent for Param
+    uint32_t index = flat_ast::no_index;
+    // For arrays: key in the parent and what has been collected so far
+    std::string key;
+    std::vector<uint32_t> items;
+    // Params are kept aside until the end of the array so that the ones of the same decl or type
+    // stay contiguous even when the types of the params have params themselves.
+    std::vector<flat_ast::Param> params;
+
+    explicit Frame(FrameKind kind, uint32_t index = flat_ast::no_index)
+        : kind(kind), index(index) {}
+  };
+
+  struct SectionData {
+    void const *data;
+    uint64_t size;
+  };
+
+  std::vector<Frame> stack;
+  llvm::SmallString<32> current_key;
+
+  std::vector<flat_ast::Decl> decls;
+  std::vector<flat_ast::Type> types;
+  std::vector<flat_ast::Param> params;
+  std::vector<uint32_t> refs;
+  flat_ast::Range top_level_decls{0, 0};
+
+  llvm::StringMap<uint32_t> string_ids;
+  std::vector<uint32_t> string_offsets;
+  std::vector<char> string_data;
+
+  static auto is_inner_type_key(llvm::StringRef key) -> bool {
+    return llvm::StringSwitch<bool>(key)
+        .Cases("pointee", "element_type", "return_type", "inner_type", true)
+        .Cases("named_type", "modified_type", "base_type", true)
+        .Default(false);
+  }
+
+  static auto align(uint64_t offset) -> uint64_t { return (offset + 7) & ~uint64_t(7); }
+
+  template <class T> static auto bytes_of(std::vector<T> const &vector) -> SectionData {
+    return {vector.data(), vector.size() * sizeof(T)};
+  }
+
+  auto new_decl() -> uint32_t {
+    flat_ast::Decl decl;
+    std::memset(&decl, 0, sizeof(decl));
+    decl.kind = decl.usr = decl.name = decl.file = decl.type = decl.related = decl.detail =
+        flat_ast::no_index;
+    decls.push_back(decl);
+    return static_cast<uint32_t>(decls.size() - 1);
+  }
+
+  auto new_type() -> uint32_t {
+    flat_ast::Type type;
+    std::memset(&type, 0, sizeof(type));
+    type.type_class = type.name = type.decl_usr = type.inner = flat_ast::no_index;
+    types.push_back(type);
+    return static_cast<uint32_t>(types.size() - 1);
+  }
+
+  // The param being filled, in the array frame just under the current Param (or ParamAttrs) frame
+  auto current_param() -> flat_ast::Param & {
+    auto param_frame = stack.size() - 1;
+    if (stack[param_frame].kind == FrameKind::ParamAttrs) {
+      --param_frame;
+    }
+    return stack[param_frame - 1].params[stack[param_frame].index];
+  }
+
+  auto string_id(llvm::StringRef value) -> uint32_t {
+    auto next_id = static_cast<uint32_t>(string_offsets.size());
+    auto inserted = string_ids.insert(std::make_pair(value, next_id));
+    if (inserted.second) {
+      string_offsets.push_back(static_cast<uint32_t>(string_data.size()));
+      string_data.insert(string_data.end(), value.begin(), value.end());
+      string_data.push_back('\0');
+    }
+    return inserted.first->second;
+  }
+};
+
+#endif
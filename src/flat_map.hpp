@@ -0,0 +1,179 @@
+#ifndef CHOCOLATIER_FLAT_MAP_HPP
+#define CHOCOLATIER_FLAT_MAP_HPP
+
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+// Map kept as a vector sorted by key, with the subset of the std::map interface nlohmann's
+// basic_json uses for its objects. The decls only have a dozen keys or so: a binary search and a
+// few moves on one contiguous block are cheaper than a node allocation and a rebalancing per key,
+// and the iteration order is still the one of std::map.
+//
+// Unlike std::map, inserting or erasing invalidates the iterators and references to the elements,
+// and at() asserts that the key is there instead of throwing: the tool is built without exceptions.
+template <class Key, class T, class Compare = std::less<Key>,
+          class Allocator = std::allocator<std::pair<Key const, T>>>
+class FlatMap {
+public:
+  using key_type = Key;
+  using mapped_type = T;
+  // The key is not const so that the elements can be moved around in the vector
+  using value_type = std::pair<Key, T>;
+  using key_compare = Compare;
+  using allocator_type =
+      typename std::allocator_traits<Allocator>::template rebind_alloc<value_type>;
+
+private:
+  using storage_type = std::vector<value_type, allocator_type>;
+
+public:
+  using size_type = typename storage_type::size_type;
+  using difference_type = typename storage_type::difference_type;
+  using reference = value_type &;
+  using const_reference = value_type const &;
+  using iterator = typename storage_type::iterator;
+  using const_iterator = typename storage_type::const_iterator;
+
+  FlatMap() = default;
+
+  template <class InputIterator>
+  FlatMap(InputIterator first, InputIterator last) {
+    insert(first, last);
+  }
+
+  auto begin() -> iterator { return elements.begin(); }
+  auto begin() const -> const_iterator { return elements.begin(); }
+  auto cbegin() const -> const_iterator { return elements.cbegin(); }
+  auto end() -> iterator { return elements.end(); }
+  auto end() const -> const_iterator { return elements.end(); }
+  auto cend() const -> const_iterator { return elements.cend(); }
+
+  auto empty() const -> bool { return elements.empty(); }
+  auto size() const -> size_type { return elements.size(); }
+  auto max_size() const -> size_type { return elements.max_size(); }
+  auto reserve(size_type count) -> void { elements.reserve(count); }
+  auto clear() -> void { elements.clear(); }
+
+  template <class K>
+  auto find(K const &key) -> iterator {
+    auto it = lower_bound(key);
+    return it != end() && !compare(key, it->first) ? it : end();
+  }
+  template <class K>
+  auto find(K const &key) const -> const_iterator {
+    auto it = lower_bound(key);
+    return it != end() && !compare(key, it->first) ? it : end();
+  }
+  template <class K>
+  auto count(K const &key) const -> size_type {
+    return find(key) != end() ? 1 : 0;
+  }
+
+  auto at(key_type const &key) -> mapped_type & {
+    auto it = find(key);
+    assert(it != end() && "FlatMap::at: missing key");
+    if (it == end()) {
+      llvm_unreachable("FlatMap::at: missing key");
+    }
+    return it->second;
+  }
+  auto at(key_type const &key) const -> mapped_type const & {
+    auto it = find(key);
+    assert(it != end() && "FlatMap::at: missing key");
+    if (it == end()) {
+      llvm_unreachable("FlatMap::at: missing key");
+    }
+    return it->second;
+  }
+
+  auto operator[](key_type const &key) -> mapped_type & {
+    return try_emplace_at(lower_bound(key), key)->second;
+  }
+  auto operator[](key_type &&key) -> mapped_type & {
+    auto it = lower_bound(key);
+    return try_emplace_at(it, std::move(key))->second;
+  }
+
+  template <class... Args>
+  auto emplace(Args &&... args) -> std::pair<iterator, bool> {
+    return insert(value_type(std::forward<Args>(args)...));
+  }
+
+  auto insert(value_type value) -> std::pair<iterator, bool> {
+    auto it = lower_bound(value.first);
+    if (it != end() && !compare(value.first, it->first)) {
+      return {it, false};
+    }
+    return {elements.insert(it, std::move(value)), true};
+  }
+
+  template <class InputIterator>
+  auto insert(InputIterator first, InputIterator last) -> void {
+    for (; first != last; ++first) {
+      insert(value_type(*first));
+    }
+  }
+
+  auto erase(const_iterator position) -> iterator { return elements.erase(position); }
+  auto erase(const_iterator first, const_iterator last) -> iterator {
+    return elements.erase(first, last);
+  }
+  auto erase(key_type const &key) -> size_type {
+    auto it = find(key);
+    if (it == end()) {
+      return 0;
+    }
+    elements.erase(it);
+    return 1;
+  }
+
+  auto swap(FlatMap &other) -> void {
+    using std::swap;
+    swap(elements, other.elements);
+    swap(compare, other.compare);
+  }
+
+  friend auto operator==(FlatMap const &lhs, FlatMap const &rhs) -> bool {
+    return lhs.elements == rhs.elements;
+  }
+  friend auto operator!=(FlatMap const &lhs, FlatMap const &rhs) -> bool {
+    return !(lhs == rhs);
+  }
+  friend auto operator<(FlatMap const &lhs, FlatMap const &rhs) -> bool {
+    return lhs.elements < rhs.elements;
+  }
+
+private:
+  storage_type elements;
+  key_compare compare;
+
+  template <class K>
+  auto lower_bound(K const &key) -> iterator {
+    return std::lower_bound(begin(), end(), key, [this](value_type const &element, K const &value) {
+      return compare(element.first, value);
+    });
+  }
+  template <class K>
+  auto lower_bound(K const &key) const -> const_iterator {
+    return std::lower_bound(begin(), end(), key, [this](value_type const &element, K const &value) {
+      return compare(element.first, value);
+    });
+  }
+
+  template <class K>
+  auto try_emplace_at(iterator it, K &&key) -> iterator {
+    if (it != end() && !compare(key, it->first)) {
+      return it;
+    }
+    return elements.emplace(it, std::piecewise_construct,
+                            std::forward_as_tuple(std::forward<K>(key)), std::forward_as_tuple());
+  }
+};
+
+#endif
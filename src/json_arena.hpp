@@ -0,0 +1,87 @@
+#ifndef CHOCOLATIER_JSON_ARENA_HPP
+#define CHOCOLATIER_JSON_ARENA_HPP
+
+#include "llvm/Support/Allocator.h"
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+// Monotonic memory for a document that is built once, written, and thrown away: allocations are
+// bumped out of large slabs and nothing is freed until the whole arena is released.
+//
+// nlohmann::basic_json default-constructs its allocators, so they cannot carry a pointer to the
+// arena. They use the one of the innermost Scope of the thread instead.
+class JSONArena {
+public:
+  JSONArena() = default;
+  JSONArena(JSONArena const &) = delete;
+  auto operator=(JSONArena const &) -> JSONArena & = delete;
+
+  class Scope {
+  public:
+    explicit Scope(JSONArena &arena) : previous(current()) { current() = &arena; }
+    Scope(Scope const &) = delete;
+    auto operator=(Scope const &) -> Scope & = delete;
+    ~Scope() { current() = previous; }
+
+  private:
+    JSONArena *previous;
+  };
+
+  static auto current() -> JSONArena *& {
+    static thread_local JSONArena *arena = nullptr;
+    return arena;
+  }
+
+  auto allocate(size_t size, size_t alignment) -> void * {
+    ++allocations;
+    return allocator.Allocate(size, alignment);
+  }
+
+  // Frees everything at once. No destructor is run, the values in the arena must not be used
+  // afterwards.
+  auto release() -> void {
+    allocator.Reset();
+    allocations = 0;
+  }
+
+  // The number of allocations that would each have been a malloc.
+  auto allocation_count() const -> uint64_t { return allocations; }
+  auto slab_count() const -> size_t { return allocator.GetNumSlabs(); }
+  auto bytes_allocated() const -> size_t { return allocator.getBytesAllocated(); }
+
+private:
+  llvm::BumpPtrAllocator allocator;
+  uint64_t allocations = 0;
+};
+
+// Standard allocator taking its memory from the current arena. Deallocation does nothing, the
+// memory comes back when the arena is released.
+template <class T>
+class ArenaAllocator {
+public:
+  using value_type = T;
+
+  ArenaAllocator() = default;
+  template <class U>
+  ArenaAllocator(ArenaAllocator<U> const &) {}
+
+  auto allocate(size_t count) -> T * {
+    auto arena = JSONArena::current();
+    assert(arena != nullptr && "arena allocation outside of a JSONArena::Scope");
+    return static_cast<T *>(arena->allocate(count * sizeof(T), alignof(T)));
+  }
+  auto deallocate(T *, size_t) -> void {}
+
+  template <class U>
+  auto operator==(ArenaAllocator<U> const &) const -> bool {
+    return true;
+  }
+  template <class U>
+  auto operator!=(ArenaAllocator<U> const &) const -> bool {
+    return false;
+  }
+};
+
+#endif
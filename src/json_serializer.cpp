@@ -11,15 +11,35 @@
 #include "clang/Index/USRGeneration.h"
 #include "clang/Tooling/CommonOptionsParser.h"
 #include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_os_ostream.h"
 
+#include "background_writer.hpp"
+#include "decl_index.hpp"
+#include "flat_ast_writer.hpp"
+#include "json_writer.hpp"
+#include "module_classifier.hpp"
+#include "path_filter.hpp"
+#include "reachable_decls.hpp"
+#include "record_encoder.hpp"
+#include "string_table_writer.hpp"
+
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <iterator>
 #include <memory>
-
-auto serialize_type(clang::Type const *type, clang::ASTContext const *context) -> nlohmann::json;
-auto serialize_type(clang::QualType const &qual_type, clang::ASTContext const *context)
-    -> nlohmann::json;
-auto serialize_decl(clang::Decl const *decl) -> nlohmann::json;
+#include <string>
+#include <vector>
 
 auto get_builtin_kind_name(clang::BuiltinType::Kind kind) -> char const * {
   switch (kind) {
@@ -122,511 +142,2367 @@ auto get_method_family_name(clang::ObjCMethodFamily family) -> char const * {
   }
 }
 
-auto generate_usr_for_decl(clang::Decl const *decl) -> llvm::SmallString<128> {
-  llvm::SmallString<128> usr;
-  clang::index::generateUSRForDecl(decl, usr);
-  return usr;
-}
+// With -numeric-enums, these values are written as their index in the tables below, which are
+// also written in the "schema" of the output. Values missing from the tables stay strings. New
+// values must only be added at the end of a table; any other change must bump the version.
+constexpr unsigned numeric_enum_schema_version = 1;
 
-auto serialize_type(clang::Type const *type, clang::ASTContext const *context) -> nlohmann::json {
-  nlohmann::json serialized_type;
+constexpr char const *schema_decl_kinds[] = {
+    "TranslationUnit", "Typedef", "ObjCInterface", "ObjCProtocol", "ObjCCategory", "ObjCMethod",
+    "Record", "Enum", "EnumConstant", "Field", "Var", "Function", "ObjCIvar", "ObjCProperty"};
 
-  // {
-  //   llvm::raw_os_ostream err{std::cerr};
-  //   err << "Type class " << type->getTypeClassName() << "\n";
-  // }
-  serialized_type["type_class"] = type->getTypeClassName();
+constexpr char const *schema_type_classes[] = {
+    "ObjCObjectPointer", "Builtin", "Pointer", "BlockPointer", "ConstantArray", "IncompleteArray",
+    "FunctionProto", "FunctionNoProto", "Paren", "Typedef", "Decayed", "Record", "Enum",
+    "ElaboratedType", "Attributed", "ObjCTypeParam", "ObjCInterface", "ObjCObject", "Vector",
+    "ExtVector"};
 
-  switch (type->getTypeClass()) {
-  case clang::Type::ObjCObjectPointer: {
-    auto objc_obj_ptr_type = static_cast<const clang::ObjCObjectPointerType *>(type);
-    auto pointee = objc_obj_ptr_type->getPointeeType();
-    serialized_type["pointee"] = serialize_type(pointee, context);
-  } break;
-  case clang::Type::Builtin: {
-    auto builtin_type = static_cast<const clang::BuiltinType *>(type);
-    serialized_type["name"] = get_builtin_kind_name(builtin_type->getKind());
-  } break;
-  case clang::Type::Pointer: {
-    auto ptr_type = static_cast<const clang::PointerType *>(type);
-    auto pointee = ptr_type->getPointeeType();
-    serialized_type["pointee"] = serialize_type(pointee, context);
-  } break;
-  case clang::Type::BlockPointer: {
-    auto block_ptr_type = static_cast<const clang::BlockPointerType *>(type);
-    auto pointee = block_ptr_type->getPointeeType();
-    serialized_type["pointee"] = serialize_type(pointee, context);
-  } break;
-  case clang::Type::ConstantArray: {
-    auto constant_array_type = static_cast<const clang::ConstantArrayType *>(type);
-    serialized_type["size"] = constant_array_type->getSize().getZExtValue();
-    serialized_type["element_type"] =
-        serialize_type(constant_array_type->getElementType(), context);
-  } break;
-  case clang::Type::IncompleteArray: {
-    auto incomplete_array_type = static_cast<const clang::IncompleteArrayType *>(type);
-    serialized_type["element_type"] =
-        serialize_type(incomplete_array_type->getElementType(), context);
-  } break;
-  case clang::Type::FunctionProto: {
-    auto function_proto_type = static_cast<const clang::FunctionProtoType *>(type);
-    serialized_type["is_variadic"] = function_proto_type->isVariadic();
-    serialized_type["return_type"] = serialize_type(function_proto_type->getReturnType(), context);
-    {
-      auto serialized_params = nlohmann::json::array();
-      auto num_params = function_proto_type->getNumParams();
-      for (unsigned i = 0; i < num_params; ++i) {
-        nlohmann::json serialized_param;
-        serialized_param["type"] = serialize_type(function_proto_type->getParamType(i), context);
-        if (function_proto_type->isParamConsumed(i)) {
-          serialized_param["is_consumed"] = true;
-        }
-        serialized_params.push_back(std::move(serialized_param));
-      }
-      serialized_type["params"] = std::move(serialized_params);
-    }
-  } break;
-  case clang::Type::FunctionNoProto: {
-    auto function_no_proto_type = static_cast<const clang::FunctionNoProtoType *>(type);
-    serialized_type["return_type"] =
-        serialize_type(function_no_proto_type->getReturnType(), context);
-  } break;
-  case clang::Type::Paren: {
-    auto paren_type = static_cast<const clang::ParenType *>(type);
-    auto inner = paren_type->getInnerType();
-    serialized_type["inner_type"] = serialize_type(inner, context);
-  } break;
-  case clang::Type::Typedef: {
-    auto typedef_type = static_cast<const clang::TypedefType *>(type);
-    auto decl = typedef_type->getDecl();
-    serialized_type["name"] = decl->getName();
-    serialized_type["decl_usr"] = generate_usr_for_decl(decl).str();
-  } break;
-  case clang::Type::Decayed: {
-    auto decayed_type = static_cast<const clang::DecayedType *>(type);
-    auto pointee = decayed_type->getPointeeType();
-    serialized_type["pointee"] = serialize_type(pointee, context);
-  } break;
-  case clang::Type::Record: {
-    auto record_type = static_cast<const clang::RecordType *>(type);
-    // A struct can contain a reference to itself so we cannot expand the decl
-    serialized_type["decl_usr"] = generate_usr_for_decl(record_type->getDecl()).str();
-  } break;
-  case clang::Type::Enum: {
-    auto enum_type = static_cast<const clang::EnumType *>(type);
-    serialized_type["decl_usr"] = generate_usr_for_decl(enum_type->getDecl()).str();
-  } break;
-  case clang::Type::Elaborated: {
-    auto elaborated_type = static_cast<const clang::ElaboratedType *>(type);
-    serialized_type["type_class"] = "ElaboratedType";
-    serialized_type["keyword"] =
-        clang::ElaboratedType::getKeywordName(elaborated_type->getKeyword());
-    serialized_type["named_type"] = serialize_type(elaborated_type->getNamedType(), context);
-  } break;
-  case clang::Type::Attributed: {
-    auto attributed_type = static_cast<const clang::AttributedType *>(type);
-    serialized_type["modified_type"] = serialize_type(attributed_type->getModifiedType(), context);
-    nlohmann::json attributes;
-    switch (attributed_type->getAttrKind()) {
-    case clang::AttributedType::Kind::attr_nonnull:
-      serialized_type["nullability"] = "nonnull";
-      break;
-    case clang::AttributedType::Kind::attr_nullable:
-      serialized_type["nullability"] = "nullable";
-      break;
-    case clang::AttributedType::Kind::attr_ns_returns_retained:
-      serialized_type["ns_returns_retained"] = true;
-      break;
-    default:
-      break;
-    }
-  } break;
-  case clang::Type::ObjCTypeParam: {
-    auto objc_type_param = static_cast<const clang::ObjCTypeParamType *>(type);
-    auto decl = objc_type_param->getDecl();
-    serialized_type["name"] = decl->getName();
-    {
-      nlohmann::json protocols;
-      for (auto const protocol : objc_type_param->getProtocols()) {
-        protocols.push_back(protocol->getName());
-      }
-      if (!protocols.empty()) {
-        serialized_type["protocols"] = protocols;
-      }
-    }
-  } break;
-  case clang::Type::ObjCInterface:
-  case clang::Type::ObjCObject: {
-    auto objc_obj_type = static_cast<const clang::ObjCObjectType *>(type);
-    auto base_type = objc_obj_type->getBaseType();
-    if (base_type->isBuiltinType()) {
-      serialized_type["base_type"] = serialize_type(base_type, context);
-    }
-    auto interface = objc_obj_type->getInterface();
-    if (interface != nullptr) {
-      serialized_type["interface_usr"] = generate_usr_for_decl(interface).str();
-    }
-    {
-      nlohmann::json protocols;
-      for (auto const protocol : objc_obj_type->getProtocols()) {
-        protocols.push_back(protocol->getName());
-      }
-      if (!protocols.empty()) {
-        serialized_type["protocols"] = protocols;
-      }
-    }
-    {
-      nlohmann::json type_args;
-      for (auto const &type_arg : objc_obj_type->getTypeArgs()) {
-        type_args.push_back(serialize_type(type_arg, context));
-      }
-      if (!type_args.empty()) {
-        serialized_type["type_args"] = type_args;
-      }
-    }
-  } break;
-  case clang::Type::Vector:
-  case clang::Type::ExtVector: {
-    auto vector_type = static_cast<const clang::VectorType *>(type);
-    serialized_type["num_elements"] = vector_type->getNumElements();
-    serialized_type["element_type"] = serialize_type(vector_type->getElementType(), context);
-  } break;
+constexpr char const *schema_builtin_names[] = {
+    "Void", "Bool", "Char_U", "UChar", "WChar_U", "Char16", "Char32", "UShort", "UInt", "ULong",
+    "ULongLong", "UInt128", "Char_S", "SChar", "WChar_S", "Short", "Int", "Long", "LongLong",
+    "Int128", "Float", "Double", "LongDouble", "Float16", "Float128", "ObjCId", "ObjCClass",
+    "ObjCSel"};
+
+constexpr char const *schema_method_families[] = {
+    "alloc", "copy", "init", "mutableCopy", "new", "autorelease", "dealloc", "finalize", "release",
+    "retain", "retainCount", "self", "initialize", "performSelector"};
+
+constexpr char const *schema_nullabilities[] = {"nonnull", "nullable"};
+
+// The size of the table if the value is not in it.
+template <size_t N>
+auto schema_index(char const *const (&table)[N], llvm::StringRef value) -> size_t {
+  return std::find(std::begin(table), std::end(table), value) - std::begin(table);
+}
+
+// The streaming writers cannot take back what they already wrote, so we must know if a decl will
+// be serialized before starting to write it.
+auto is_serializable_decl(clang::Decl const *decl) -> bool {
+  switch (decl->getKind()) {
+  case clang::Decl::Empty:
+    // We don't care about empty declarations
+    return false;
+  case clang::Decl::Typedef:
+  case clang::Decl::ObjCInterface:
+  case clang::Decl::ObjCProtocol:
+  case clang::Decl::ObjCCategory:
+  case clang::Decl::ObjCMethod:
+  case clang::Decl::Record:
+  case clang::Decl::Enum:
+  case clang::Decl::EnumConstant:
+  case clang::Decl::Field:
+  case clang::Decl::Var:
+  case clang::Decl::Function:
+  case clang::Decl::ObjCIvar:
+  case clang::Decl::ObjCProperty:
+    return true;
   default: {
     llvm::raw_os_ostream err{std::cerr};
-    err << "Unknown type class " << type->getTypeClassName() << "\n";
-  } break;
+    err << "Unknown decl kind " << decl->getDeclKindName() << " for:";
+    decl->print(err);
+    err << "\n";
+    return false;
   }
+  }
+}
 
-  return serialized_type;
+// The Objective-C meaning of a type, so that consumers do not have to recognize the type trees
+// themselves. Typedefs only get a tag when they are the runtime typedef itself (BOOL, instancetype,
+// id, SEL, Class): the ones defined on top of them keep being plain typedefs.
+auto get_semantic_tag(clang::Type const *type) -> char const * {
+  switch (type->getTypeClass()) {
+  case clang::Type::Typedef: {
+    auto name = static_cast<clang::TypedefType const *>(type)->getDecl()->getName();
+    auto canonical_type = type->getCanonicalTypeInternal();
+    if (name == "BOOL" && (canonical_type->isSpecificBuiltinType(clang::BuiltinType::SChar) ||
+                           canonical_type->isSpecificBuiltinType(clang::BuiltinType::Bool))) {
+      return "objc_bool";
+    }
+    if (name == "instancetype" && canonical_type->isObjCIdType()) {
+      return "instancetype";
+    }
+    if ((name == "id" && canonical_type->isObjCIdType()) ||
+        (name == "SEL" && canonical_type->isObjCSelType()) ||
+        (name == "Class" && canonical_type->isObjCClassType())) {
+      return get_semantic_tag(canonical_type.getTypePtr());
+    }
+    return nullptr;
+  }
+  case clang::Type::ObjCObjectPointer: {
+    auto objc_obj_ptr_type = static_cast<clang::ObjCObjectPointerType const *>(type);
+    // With or without protocols
+    if (objc_obj_ptr_type->isObjCIdType() || objc_obj_ptr_type->isObjCQualifiedIdType()) {
+      return "objc_id";
+    }
+    if (objc_obj_ptr_type->isObjCClassType() || objc_obj_ptr_type->isObjCQualifiedClassType()) {
+      return "objc_class";
+    }
+    return nullptr;
+  }
+  case clang::Type::Pointer:
+    return type->isObjCSelType() ? "objc_sel" : nullptr;
+  case clang::Type::BlockPointer:
+    return "block";
+  default:
+    return nullptr;
+  }
 }
 
-auto serialize_type(clang::QualType const &qual_type, clang::ASTContext const *context)
-    -> nlohmann::json {
-  return serialize_type(qual_type.getTypePtr(), context);
+// The only redeclaration written with -dedup: the definition if there is one, the first
+// declaration otherwise.
+auto get_representative_decl(clang::Decl const *decl) -> clang::Decl const * {
+  clang::Decl const *definition = nullptr;
+  switch (decl->getKind()) {
+  case clang::Decl::ObjCInterface:
+    definition = static_cast<clang::ObjCInterfaceDecl const *>(decl)->getDefinition();
+    break;
+  case clang::Decl::ObjCProtocol:
+    definition = static_cast<clang::ObjCProtocolDecl const *>(decl)->getDefinition();
+    break;
+  case clang::Decl::Record:
+  case clang::Decl::Enum:
+    definition = static_cast<clang::TagDecl const *>(decl)->getDefinition();
+    break;
+  case clang::Decl::Function:
+    definition = static_cast<clang::FunctionDecl const *>(decl)->getDefinition();
+    break;
+  case clang::Decl::Var:
+    definition = static_cast<clang::VarDecl const *>(decl)->getDefinition();
+    break;
+  default:
+    break;
+  }
+  return definition != nullptr ? definition : decl->getCanonicalDecl();
 }
 
-auto serialize_decl_children(clang::DeclContext const *decl_context) -> nlohmann::json {
-  auto children = nlohmann::json::array();
-  for (auto const child_decl : decl_context->decls()) {
-    auto child = serialize_decl(child_decl);
-    if (!child.is_null()) {
-      children.push_back(child);
+// Keys of decls that can be left out with -fields. kind and the decls inside other decls (children,
+// fields and enumerators) are always written.
+enum DeclField : uint32_t {
+  FieldIsImplicit = 1 << 0,
+  FieldIsReferenced = 1 << 1,
+  FieldUSR = 1 << 2,
+  FieldLocation = 1 << 3,
+  FieldName = 1 << 4,
+  FieldType = 1 << 5,
+  FieldIsForwardDeclaration = 1 << 6,
+  FieldProtocols = 1 << 7,
+  FieldSuperClass = 1 << 8,
+  FieldTypeParams = 1 << 9,
+  FieldClassName = 1 << 10,
+  FieldSelector = 1 << 11,
+  FieldIsInstanceMethod = 1 << 12,
+  FieldMethodFamily = 1 << 13,
+  FieldIsVariadic = 1 << 14,
+  FieldParams = 1 << 15,
+  FieldReturnType = 1 << 16,
+  FieldImplementationControl = 1 << 17,
+  FieldAttrs = 1 << 18,
+  FieldTagKind = 1 << 19,
+  FieldIsClosed = 1 << 20,
+  FieldIsFlag = 1 << 21,
+  FieldIntegerType = 1 << 22,
+  FieldValue = 1 << 23,
+  FieldBitWidth = 1 << 24,
+  FieldHasBody = 1 << 25,
+  FieldPropertyImplementation = 1 << 26,
+  AllDeclFields = (1 << 27) - 1,
+};
+
+enum ParamField : uint32_t {
+  ParamFieldName = 1 << 0,
+  ParamFieldType = 1 << 1,
+  ParamFieldAttrs = 1 << 2,
+  AllParamFields = (1 << 3) - 1,
+};
+
+struct NamedField {
+  char const *name;
+  uint32_t field;
+};
+
+// Names as given to -fields, the same as the keys in the output (usr and super_class_usr also
+// select their -decl-ids variant)
+static constexpr NamedField decl_field_names[] = {
+    {"is_implicit", FieldIsImplicit},
+    {"is_referenced", FieldIsReferenced},
+    {"usr", FieldUSR},
+    {"location", FieldLocation},
+    {"name", FieldName},
+    {"type", FieldType},
+    {"is_forward_declaration", FieldIsForwardDeclaration},
+    {"protocols", FieldProtocols},
+    {"super_class_usr", FieldSuperClass},
+    {"type_params", FieldTypeParams},
+    {"class_name", FieldClassName},
+    {"selector", FieldSelector},
+    {"is_instance_method", FieldIsInstanceMethod},
+    {"method_family", FieldMethodFamily},
+    {"is_variadic", FieldIsVariadic},
+    {"params", FieldParams},
+    {"return_type", FieldReturnType},
+    {"implementation_control", FieldImplementationControl},
+    {"attrs", FieldAttrs},
+    {"tag_kind", FieldTagKind},
+    {"is_closed", FieldIsClosed},
+    {"is_flag", FieldIsFlag},
+    {"integer_type", FieldIntegerType},
+    {"value", FieldValue},
+    {"bit_width", FieldBitWidth},
+    {"has_body", FieldHasBody},
+    {"property_implementation", FieldPropertyImplementation},
+};
+
+static constexpr NamedField param_field_names[] = {
+    {"name", ParamFieldName},
+    {"type", ParamFieldType},
+    {"attrs", ParamFieldAttrs},
+};
+
+// Typed records for the signatures of the methods and functions, the part of the output Converter
+// relies on the most. serialize_decl fills them from the AST and writes them with a RecordEncoder.
+//
+// Only these signatures have records:
+// - The other decls are a name and a type, or a name and a flag or two around their children,
+//   fields or enumerators, which serialize_decl writes recursively as it walks them. A record
+//   would hold little more than the child decls to hand back to serialize_decl.
+// - The types stay clang types, which serialize_type writes: it walks them with an explicit stack
+//   and interns them with -intern-types. A record per type would be a tree allocated for each use
+//   only to be walked again.
+
+struct AttrsIR {
+  Flag self_is_consumed{false};
+  Flag ns_returns_retained{false};
+  Flag is_consumed{false};
+
+  static constexpr auto fields() {
+    return std::make_tuple(record_field("self_is_consumed", &AttrsIR::self_is_consumed),
+                           record_field("ns_returns_retained", &AttrsIR::ns_returns_retained),
+                           record_field("is_consumed", &AttrsIR::is_consumed));
+  }
+
+  // Decls without attributes have no "attrs" at all.
+  auto if_any() const -> llvm::Optional<AttrsIR> {
+    if (self_is_consumed.value || ns_returns_retained.value || is_consumed.value) {
+      return *this;
     }
+    return llvm::None;
   }
-  return children;
-}
+};
+
+struct ParamIR {
+  llvm::StringRef name;
+  clang::QualType type;
+  llvm::Optional<AttrsIR> attrs;
+
+  static constexpr auto fields() {
+    return std::make_tuple(record_field("name", &ParamIR::name, ParamFieldName),
+                           record_field("type", &ParamIR::type, ParamFieldType),
+                           record_field("attrs", &ParamIR::attrs, ParamFieldAttrs));
+  }
+};
+
+using ParamIRs = llvm::SmallVector<ParamIR, 4>;
+
+struct MethodIR {
+  std::string selector;
+  bool is_instance_method;
+  llvm::Optional<clang::ObjCMethodFamily> method_family;
+  bool is_variadic;
+  ParamIRs params;
+  clang::QualType return_type;
+  llvm::Optional<llvm::StringRef> implementation_control;
+  llvm::Optional<AttrsIR> attrs;
+
+  static constexpr auto fields() {
+    return std::make_tuple(
+        record_field("selector", &MethodIR::selector, FieldSelector),
+        record_field("is_instance_method", &MethodIR::is_instance_method, FieldIsInstanceMethod),
+        record_field("method_family", &MethodIR::method_family, FieldMethodFamily),
+        record_field("is_variadic", &MethodIR::is_variadic, FieldIsVariadic),
+        record_field("params", &MethodIR::params, FieldParams),
+        record_field("return_type", &MethodIR::return_type, FieldReturnType),
+        record_field("implementation_control", &MethodIR::implementation_control,
+                     FieldImplementationControl),
+        record_field("attrs", &MethodIR::attrs, FieldAttrs));
+  }
+};
+
+struct FunctionIR {
+  llvm::StringRef name;
+  clang::QualType type;
+  bool is_variadic;
+  ParamIRs params;
+  bool has_body;
+  llvm::Optional<AttrsIR> attrs;
+
+  static constexpr auto fields() {
+    return std::make_tuple(record_field("name", &FunctionIR::name, FieldName),
+                           record_field("type", &FunctionIR::type, FieldType),
+                           record_field("is_variadic", &FunctionIR::is_variadic, FieldIsVariadic),
+                           record_field("params", &FunctionIR::params, FieldParams),
+                           record_field("has_body", &FunctionIR::has_body, FieldHasBody),
+                           record_field("attrs", &FunctionIR::attrs, FieldAttrs));
+  }
+};
+
+// -fields selects the keys of these records by name
+static_assert(record_keys_match(ParamIR::fields(), param_field_names), "ParamIR keys");
+static_assert(record_keys_match(MethodIR::fields(), decl_field_names), "MethodIR keys");
+static_assert(record_keys_match(FunctionIR::fields(), decl_field_names), "FunctionIR keys");
 
 template <class DeclType>
-auto add_protocols_if_any(nlohmann::json &serialized_decl, DeclType *decl) -> void {
-  {
-    nlohmann::json protocols;
-    for (auto const protocol : decl->protocols()) {
-      protocols.push_back(protocol->getName());
+auto get_param_irs(DeclType const *decl) -> ParamIRs {
+  ParamIRs params;
+  for (auto const parm_decl : decl->parameters()) {
+    AttrsIR attrs;
+    attrs.is_consumed.value = parm_decl->template hasAttr<clang::NSConsumedAttr>();
+    params.push_back(ParamIR{parm_decl->getName(), parm_decl->getType(), attrs.if_any()});
+  }
+  return params;
+}
+
+auto get_method_ir(clang::ObjCMethodDecl const *method_decl) -> MethodIR {
+  MethodIR method;
+  method.selector = method_decl->getSelector().getAsString();
+  method.is_instance_method = method_decl->isInstanceMethod();
+  if (get_method_family_name(method_decl->getMethodFamily()) != nullptr) {
+    method.method_family = method_decl->getMethodFamily();
+  }
+  method.is_variadic = method_decl->isVariadic();
+  method.params = get_param_irs(method_decl);
+  method.return_type = method_decl->getReturnType();
+  switch (method_decl->getImplementationControl()) {
+  case clang::ObjCMethodDecl::Optional:
+    method.implementation_control = llvm::StringRef("optional");
+    break;
+  case clang::ObjCMethodDecl::Required:
+    method.implementation_control = llvm::StringRef("required");
+    break;
+  default:
+    break;
+  }
+  AttrsIR attrs;
+  attrs.self_is_consumed.value = method_decl->hasAttr<clang::NSConsumesSelfAttr>();
+  attrs.ns_returns_retained.value = method_decl->hasAttr<clang::NSReturnsRetainedAttr>();
+  method.attrs = attrs.if_any();
+  return method;
+}
+
+auto get_function_ir(clang::FunctionDecl const *function_decl) -> FunctionIR {
+  FunctionIR function;
+  function.name = function_decl->getName();
+  function.type = function_decl->getType();
+  function.is_variadic = function_decl->isVariadic();
+  function.params = get_param_irs(function_decl);
+  function.has_body = function_decl->hasBody();
+  AttrsIR attrs;
+  attrs.ns_returns_retained.value = function_decl->hasAttr<clang::NSReturnsRetainedAttr>();
+  function.attrs = attrs.if_any();
+  return function;
+}
+
+struct SerializerOptions {
+  // Write each distinct type once in a "types" table and only its index where it is used
+  bool intern_types = false;
+  // Write each distinct USR once in a "usrs" table and refer to decls by their index in it
+  bool decl_ids = false;
+  // Write each file path once in a "files" table and locations as {file_id, line}
+  bool file_ids = false;
+  // Replace USRs, selectors, names and file paths by ids in a front-coded "string_table"
+  bool string_table = false;
+  // Write the translation unit as a sequence of top-level values instead of a single object: a
+  // header, then each top-level decl and then each table
+  bool json_lines = false;
+  // DeclField and ParamField masks of what to write
+  uint32_t decl_fields = AllDeclFields;
+  uint32_t param_fields = AllParamFields;
+  // Only top-level decls from files accepted by all of these are written
+  std::string include_path_regex;
+  std::string exclude_path_regex;
+  std::vector<std::string> frameworks;
+  // Only write the top-level decls the Objective-C API uses (needs the whole TU)
+  bool reachable_only = false;
+  // Only write these classes and protocols (prefixed by @), and what they need
+  std::vector<std::string> roots;
+  // Only write one redeclaration of each top-level decl
+  bool dedup = false;
+  // Write the locations of the other redeclarations in the one written
+  bool redecl_locations = false;
+  // Write the module of each top-level decl
+  bool modules = false;
+  // Write the Objective-C meaning of types (see get_semantic_tag)
+  bool semantic_tags = false;
+  // Write kinds, type classes, builtin names, method families and nullabilities as numbers
+  bool numeric_enums = false;
+};
+
+// Fills the field masks of the options from a list like "name,usr,params.type". Returns the first
+// unknown field, if any.
+auto parse_field_list(llvm::ArrayRef<std::string> fields, SerializerOptions &options)
+    -> llvm::Optional<std::string> {
+  auto find_field = [](llvm::ArrayRef<NamedField> names, llvm::StringRef name) -> uint32_t {
+    for (auto const &field_name : names) {
+      if (name == field_name.name) {
+        return field_name.field;
+      }
+    }
+    return 0;
+  };
+
+  options.decl_fields = 0;
+  options.param_fields = 0;
+  llvm::StringRef params_prefix = "params.";
+  for (auto const &field : fields) {
+    llvm::StringRef name = field;
+    if (name == "kind" || name == "children" || name == "fields" || name == "enumerators") {
+      continue;
     }
-    if (!protocols.empty()) {
-      serialized_decl["protocols"] = protocols;
+    uint32_t found;
+    if (name.startswith(params_prefix)) {
+      found = find_field(param_field_names, name.drop_front(params_prefix.size()));
+      options.decl_fields |= FieldParams;
+      options.param_fields |= found;
+    } else {
+      found = find_field(decl_field_names, name);
+      options.decl_fields |= found;
+      if (found == FieldParams) {
+        options.param_fields = AllParamFields;
+      }
+    }
+    if (found == 0) {
+      return field;
     }
   }
+  return llvm::None;
 }
 
-auto serialize_decl(clang::Decl const *decl) -> nlohmann::json {
-  // We don't care about empty declarations
-  if (decl->getKind() == clang::Decl::Empty) {
-    return nullptr;
+// Decides which top-level decls are written, from the path filters, -reachable-only, -roots and
+// -dedup. It can be shared by several serializers writing parts of the same TU.
+class TopLevelDeclFilter {
+public:
+  explicit TopLevelDeclFilter(SerializerOptions const &options)
+      : path_filter(options.include_path_regex, options.exclude_path_regex, options.frameworks),
+        reachable_only(options.reachable_only), roots(options.roots), dedup(options.dedup) {}
+
+  // Must be called with the whole TU before accepts() if -reachable-only or -roots are used.
+  auto prepare(clang::TranslationUnitDecl const *tu_decl) -> void {
+    if (!roots.empty()) {
+      find_decls_reachable_from_roots(tu_decl);
+    } else if (reachable_only) {
+      find_reachable_decls(tu_decl);
+    }
+  }
+
+  auto accepts(clang::Decl const *decl) -> bool {
+    if (path_filter.is_active() && !is_in_accepted_file(decl)) {
+      return false;
+    }
+    if (reachable_decls && !reachable_decls->contains(decl)) {
+      return false;
+    }
+    if (dedup && get_representative_decl(decl) != decl) {
+      return false;
+    }
+    return true;
   }
 
-  auto context = &decl->getASTContext();
-  nlohmann::json serialized_decl;
+  // Classes only referenced with -roots are written as forward declarations.
+  auto is_only_referenced(clang::Decl const *decl) const -> bool {
+    return reachable_decls && reachable_decls->is_only_referenced(decl);
+  }
+
+private:
+  PathFilter path_filter;
+  bool reachable_only;
+  std::vector<std::string> roots;
+  bool dedup;
+  llvm::DenseMap<clang::FileID, bool> accepted_files;
+  std::unique_ptr<ReachableDecls> reachable_decls;
 
-  serialized_decl["kind"] = decl->getDeclKindName();
-  serialized_decl["is_implicit"] = decl->isImplicit();
-  serialized_decl["is_referenced"] = decl->isReferenced();
-  serialized_decl["usr"] = generate_usr_for_decl(decl).str();
-  {
+  auto is_in_accepted_file(clang::Decl const *decl) -> bool {
     auto location = decl->getLocation();
-    if (location.isValid()) {
-      auto const &source_manager = context->getSourceManager();
-      auto presumed_loc = source_manager.getPresumedLoc(location);
-      if (!presumed_loc.isInvalid()) {
-        nlohmann::json serialized_location;
-        serialized_location["file"] = presumed_loc.getFilename();
-        serialized_location["line"] = presumed_loc.getLine();
-        serialized_decl["location"] = serialized_location;
-      }
+    // Decls without location are builtins, always needed
+    if (location.isInvalid()) {
+      return true;
     }
+    auto const &source_manager = decl->getASTContext().getSourceManager();
+    auto file_id = source_manager.getFileID(source_manager.getExpansionLoc(location));
+    auto found = accepted_files.find(file_id);
+    if (found != accepted_files.end()) {
+      return found->second;
+    }
+    auto presumed_loc = source_manager.getPresumedLoc(location);
+    bool accepted = presumed_loc.isInvalid() || path_filter.accepts(presumed_loc.getFilename());
+    accepted_files.insert({file_id, accepted});
+    return accepted;
   }
 
-  // {
-  //   llvm::raw_os_ostream err{std::cerr};
-  //   err << "Decl kind " << decl->getDeclKindName() << " for:";
-  //   decl->print(err);
-  //   err << "\n";
-  // }
+  // The roots are the Objective-C containers that get through the path filter.
+  auto find_reachable_decls(clang::TranslationUnitDecl const *tu_decl) -> void {
+    reachable_decls = std::make_unique<ReachableDecls>();
+    for (auto const child_decl : tu_decl->decls()) {
+      if (ReachableDecls::is_root(child_decl) &&
+          (!path_filter.is_active() || is_in_accepted_file(child_decl))) {
+        reachable_decls->add_root(child_decl);
+      }
+    }
+  }
 
-  switch (decl->getKind()) {
-  case clang::Decl::Typedef: {
-    auto typedef_decl = static_cast<const clang::TypedefDecl *>(decl);
-    serialized_decl["name"] = typedef_decl->getName();
-    auto typedef_type = context->getTypedefType(typedef_decl);
-    serialized_decl["type"] = serialize_type(typedef_type.getCanonicalType(), context);
-  } break;
-  case clang::Decl::ObjCInterface: {
-    auto objc_interface_decl = static_cast<const clang::ObjCInterfaceDecl *>(decl);
-    serialized_decl["name"] = objc_interface_decl->getName();
-    bool is_forward_declaration = objc_interface_decl->getDefinition() != objc_interface_decl;
-    serialized_decl["is_forward_declaration"] = is_forward_declaration;
-    if (!is_forward_declaration) {
-      serialized_decl["children"] = serialize_decl_children(objc_interface_decl);
-    }
-    add_protocols_if_any(serialized_decl, objc_interface_decl);
-    auto super_class = objc_interface_decl->getSuperClass();
-    if (super_class != nullptr) {
-      serialized_decl["super_class_usr"] = generate_usr_for_decl(super_class).str();
-    }
-    auto type_param_list = objc_interface_decl->getTypeParamList();
-    if (type_param_list != nullptr) {
-      nlohmann::json type_params;
-      for (auto const type_param : *type_param_list) {
-        type_params.push_back(type_param->getName());
-      }
-      if (!type_params.empty()) {
-        serialized_decl["type_params"] = type_params;
-      }
-    }
-  } break;
-  case clang::Decl::ObjCProtocol: {
-    auto objc_protocol_decl = static_cast<const clang::ObjCProtocolDecl *>(decl);
-    serialized_decl["name"] = objc_protocol_decl->getName();
-    bool is_forward_declaration = objc_protocol_decl->getDefinition() != objc_protocol_decl;
-    serialized_decl["is_forward_declaration"] = is_forward_declaration;
-    if (!is_forward_declaration) {
-      serialized_decl["children"] = serialize_decl_children(objc_protocol_decl);
-    }
-    add_protocols_if_any(serialized_decl, objc_protocol_decl);
-  } break;
-  case clang::Decl::ObjCCategory: {
-    auto objc_category_decl = static_cast<const clang::ObjCCategoryDecl *>(decl);
-    auto class_interface = objc_category_decl->getClassInterface();
-    serialized_decl["name"] = objc_category_decl->getName();
-    serialized_decl["class_name"] = class_interface->getName();
-    serialized_decl["children"] = serialize_decl_children(objc_category_decl);
-    add_protocols_if_any(serialized_decl, objc_category_decl);
-  } break;
-  case clang::Decl::ObjCMethod: {
-    nlohmann::json decl_attrs;
-    auto objc_method_decl = static_cast<const clang::ObjCMethodDecl *>(decl);
-    serialized_decl["selector"] = objc_method_decl->getSelector().getAsString();
-    serialized_decl["is_instance_method"] = objc_method_decl->isInstanceMethod();
-    auto method_family_name = get_method_family_name(objc_method_decl->getMethodFamily());
-    if (method_family_name != nullptr) {
-      serialized_decl["method_family"] = method_family_name;
-    }
-    serialized_decl["is_variadic"] = objc_method_decl->isVariadic();
-    {
-      auto serialized_params = nlohmann::json::array();
-      for (auto const parm_decl : objc_method_decl->parameters()) {
-        nlohmann::json serialized_param;
-        nlohmann::json param_attrs;
-        serialized_param["name"] = parm_decl->getName();
-        serialized_param["type"] = serialize_type(parm_decl->getType(), context);
-        if (parm_decl->hasAttr<clang::NSConsumedAttr>()) {
-          param_attrs["is_consumed"] = true;
-        }
-        if (!param_attrs.empty()) {
-          serialized_param["attrs"] = param_attrs;
-        }
-        serialized_params.push_back(std::move(serialized_param));
+  auto find_decls_reachable_from_roots(clang::TranslationUnitDecl const *tu_decl) -> void {
+    reachable_decls = std::make_unique<ReachableDecls>(false);
+    llvm::StringSet<> missing_roots;
+    for (auto const &root : roots) {
+      missing_roots.insert(root);
+    }
+    for (auto const child_decl : tu_decl->decls()) {
+      if (!ReachableDecls::is_root(child_decl) || llvm::isa<clang::ObjCCategoryDecl>(child_decl)) {
+        continue;
+      }
+      auto name = llvm::cast<clang::ObjCContainerDecl>(child_decl)->getName();
+      auto root = llvm::isa<clang::ObjCProtocolDecl>(child_decl) ? ("@" + name).str() : name.str();
+      if (missing_roots.erase(root)) {
+        reachable_decls->add_root(child_decl);
       }
-      serialized_decl["params"] = std::move(serialized_params);
     }
-    if (objc_method_decl->hasAttr<clang::NSConsumesSelfAttr>()) {
-      decl_attrs["self_is_consumed"] = true;
+    for (auto const &missing_root : missing_roots) {
+      std::cerr << "Could not find the definition of root " << missing_root.getKey().str() << "\n";
     }
-    if (objc_method_decl->hasAttr<clang::NSReturnsRetainedAttr>()) {
-      decl_attrs["ns_returns_retained"] = true;
+  }
+};
+
+// Walks the AST and describes it to a JSONWriter.
+class ASTSerializer {
+public:
+  // If an index is given, the output must be the JSONTextWriter the index was created with.
+  // Without a filter, the serializer uses its own.
+  ASTSerializer(JSONWriter &output, SerializerOptions const &options,
+                DeclIndexBuilder *index = nullptr,
+                std::shared_ptr<TopLevelDeclFilter> top_level_filter = nullptr)
+      : string_table_writer(options.string_table ? std::make_unique<StringTableWriter>(output)
+                                                 : nullptr),
+        writer(string_table_writer ? *string_table_writer : output), options(options),
+        index(index),
+        top_level_filter(top_level_filter ? std::move(top_level_filter)
+                                          : std::make_shared<TopLevelDeclFilter>(options)),
+        module_classifier(options.modules ? std::make_unique<ModuleClassifier>() : nullptr) {}
+
+  // Top-level decls are filtered before doing anything else.
+  auto serialize_top_level_decl(clang::Decl const *decl) -> bool {
+    if (!top_level_filter->accepts(decl)) {
+      return false;
     }
-    serialized_decl["return_type"] = serialize_type(objc_method_decl->getReturnType(), context);
-    switch (objc_method_decl->getImplementationControl()) {
-    case clang::ObjCMethodDecl::Optional:
-      serialized_decl["implementation_control"] = "optional";
-      break;
-    case clang::ObjCMethodDecl::Required:
-      serialized_decl["implementation_control"] = "required";
-      break;
-    default:
-      break;
+    return serialize_decl(decl);
+  }
+
+  auto serialize_decl(clang::Decl const *decl) -> bool {
+    if (!is_serializable_decl(decl)) {
+      return false;
     }
-    if (!decl_attrs.empty()) {
-      serialized_decl["attrs"] = decl_attrs;
-    }
-  } break;
-  case clang::Decl::Record: {
-    auto record_decl = static_cast<const clang::RecordDecl *>(decl);
-    serialized_decl["name"] = record_decl->getName();
-    auto is_forward_declaration = !record_decl->isCompleteDefinition();
-    serialized_decl["is_forward_declaration"] = is_forward_declaration;
-    if (!is_forward_declaration) {
-      auto fields = nlohmann::json::array();
-      for (auto const field_decl : record_decl->fields()) {
-        // All enumerators should be instances of EnumConstantDecl
-        fields.push_back(serialize_decl(field_decl));
-      }
-      serialized_decl["fields"] = std::move(fields);
-    }
-    serialized_decl["tag_kind"] = record_decl->getKindName();
-  } break;
-  case clang::Decl::Enum: {
-    auto enum_decl = static_cast<const clang::EnumDecl *>(decl);
-    serialized_decl["name"] = enum_decl->getName();
-    serialized_decl["is_closed"] = enum_decl->isClosed();
-    serialized_decl["is_flag"] = enum_decl->hasAttr<clang::FlagEnumAttr>();
-    auto integer_type = enum_decl->getIntegerType();
-    if (!integer_type.isNull()) {
-      serialized_decl["integer_type"] = serialize_type(integer_type, context);
-    }
-    auto is_forward_declaration = !enum_decl->isCompleteDefinition();
-    serialized_decl["is_forward_declaration"] = is_forward_declaration;
-    if (!is_forward_declaration) {
-      auto enumerators = nlohmann::json::array();
-      for (auto const enumerator_decl : enum_decl->enumerators()) {
-        // All enumerators should be instances of EnumConstantDecl
-        enumerators.push_back(serialize_decl(enumerator_decl));
-      }
-      serialized_decl["enumerators"] = std::move(enumerators);
-    }
-  } break;
-  case clang::Decl::EnumConstant: {
-    auto enum_constant_decl = static_cast<const clang::EnumConstantDecl *>(decl);
-    serialized_decl["name"] = enum_constant_decl->getName();
-    auto qual_type = enum_constant_decl->getType();
-    // JSON's precision of numbers doesn't seem to be well defined so to be sure we keep the full
-    // precision store them as decimal strings.
-    if (qual_type->isSignedIntegerType()) {
-      serialized_decl["value"] = enum_constant_decl->getInitVal().toString(10, true);
-    } else if (qual_type->isUnsignedIntegerType()) {
-      serialized_decl["value"] = enum_constant_decl->getInitVal().toString(10, false);
-    } else {
-      llvm::raw_os_ostream err{std::cerr};
-      err << "\n";
-      err << "Could not find if ";
-      qual_type.print(err, context->getPrintingPolicy());
-      err << " is signed or not\n";
-    }
-  } break;
-  case clang::Decl::Field: {
-    auto field_decl = static_cast<const clang::FieldDecl *>(decl);
-    serialized_decl["name"] = field_decl->getName();
-    serialized_decl["type"] = serialize_type(field_decl->getType(), context);
-    if (field_decl->isBitField()) {
-      serialized_decl["bit_width"] = field_decl->getBitWidthValue(*context);
-    }
-  } break;
-  case clang::Decl::Var: {
-    auto var_decl = static_cast<const clang::VarDecl *>(decl);
-    serialized_decl["name"] = var_decl->getName();
-    serialized_decl["type"] = serialize_type(var_decl->getType(), context);
-  } break;
-  case clang::Decl::Function: {
-    nlohmann::json decl_attrs;
-    auto function_decl = static_cast<const clang::FunctionDecl *>(decl);
-    serialized_decl["name"] = function_decl->getName();
-    serialized_decl["type"] = serialize_type(function_decl->getType(), context);
-    serialized_decl["is_variadic"] = function_decl->isVariadic();
-    {
-      auto serialized_params = nlohmann::json::array();
-      for (auto const parm_var_decl : function_decl->parameters()) {
-        nlohmann::json serialized_param;
-        nlohmann::json param_attrs;
-        serialized_param["name"] = parm_var_decl->getName();
-        serialized_param["type"] = serialize_type(parm_var_decl->getType(), context);
-        if (parm_var_decl->hasAttr<clang::NSConsumedAttr>()) {
-          param_attrs["is_consumed"] = true;
-        }
-        if (!param_attrs.empty()) {
-          serialized_param["attrs"] = param_attrs;
+
+    auto context = &decl->getASTContext();
+    writer.start_object();
+    auto index_start_offset = index != nullptr ? index->decl_started() : 0;
+
+    writer.key("kind");
+    write_enum(schema_decl_kinds, decl->getDeclKindName());
+    if (wants(FieldIsImplicit)) {
+      writer.key("is_implicit");
+      writer.boolean(decl->isImplicit());
+    }
+    if (wants(FieldIsReferenced)) {
+      writer.key("is_referenced");
+      writer.boolean(decl->isReferenced());
+    }
+    if (wants(FieldUSR)) {
+      write_decl_reference("usr", "id", decl);
+    }
+    if (wants(FieldLocation)) {
+      write_location(context->getSourceManager(), decl->getLocation());
+    }
+    if (options.redecl_locations) {
+      write_redecl_locations(context->getSourceManager(), decl);
+    }
+    if (module_classifier && decl->getDeclContext()->isTranslationUnit()) {
+      auto module = module_classifier->module_of(decl);
+      if (!module.empty()) {
+        writer.key("module");
+        writer.string(module);
+      }
+    }
+
+    // {
+    //   llvm::raw_os_ostream err{std::cerr};
+    //   err << "Decl kind " << decl->getDeclKindName() << " for:";
+    //   decl->print(err);
+    //   err << "\n";
+    // }
+
+    switch (decl->getKind()) {
+    case clang::Decl::Typedef: {
+      auto typedef_decl = static_cast<const clang::TypedefDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(typedef_decl->getName());
+      }
+      auto typedef_type = context->getTypedefType(typedef_decl);
+      if (wants(FieldType)) {
+        writer.key("type");
+        serialize_type(typedef_type.getCanonicalType());
+      }
+    } break;
+    case clang::Decl::ObjCInterface: {
+      auto objc_interface_decl = static_cast<const clang::ObjCInterfaceDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(objc_interface_decl->getName());
+      }
+      bool is_forward_declaration = objc_interface_decl->getDefinition() != objc_interface_decl ||
+                                    top_level_filter->is_only_referenced(decl);
+      if (wants(FieldIsForwardDeclaration)) {
+        writer.key("is_forward_declaration");
+        writer.boolean(is_forward_declaration);
+      }
+      if (!is_forward_declaration) {
+        writer.key("children");
+        serialize_decl_children(objc_interface_decl);
+      }
+      add_protocols_if_any(objc_interface_decl);
+      auto super_class = objc_interface_decl->getSuperClass();
+      if (super_class != nullptr && wants(FieldSuperClass)) {
+        write_decl_reference("super_class_usr", "super_class_id", super_class);
+      }
+      auto type_param_list = objc_interface_decl->getTypeParamList();
+      if (type_param_list != nullptr && type_param_list->size() != 0 && wants(FieldTypeParams)) {
+        writer.key("type_params");
+        writer.start_array();
+        for (auto const type_param : *type_param_list) {
+          writer.string(type_param->getName());
         }
-        serialized_params.push_back(std::move(serialized_param));
-      }
-      serialized_decl["params"] = std::move(serialized_params);
-    }
-    serialized_decl["has_body"] = function_decl->hasBody();
-    if (function_decl->hasAttr<clang::NSReturnsRetainedAttr>()) {
-      decl_attrs["ns_returns_retained"] = true;
-    }
-    if (!decl_attrs.empty()) {
-      serialized_decl["attrs"] = decl_attrs;
-    }
-  } break;
-  case clang::Decl::ObjCIvar: {
-    auto objc_ivar_decl = static_cast<const clang::ObjCIvarDecl *>(decl);
-    serialized_decl["name"] = objc_ivar_decl->getName();
-    serialized_decl["type"] = serialize_type(objc_ivar_decl->getType(), context);
-  } break;
-  case clang::Decl::ObjCProperty: {
-    auto objc_property_decl = static_cast<const clang::ObjCPropertyDecl *>(decl);
-    serialized_decl["name"] = objc_property_decl->getName();
-    serialized_decl["type"] = serialize_type(objc_property_decl->getType(), context);
-    switch (objc_property_decl->getPropertyImplementation()) {
-    case clang::ObjCPropertyDecl::Optional:
-      serialized_decl["property_implementation"] = "optional";
+        writer.end_array();
+      }
+    } break;
+    case clang::Decl::ObjCProtocol: {
+      auto objc_protocol_decl = static_cast<const clang::ObjCProtocolDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(objc_protocol_decl->getName());
+      }
+      bool is_forward_declaration = objc_protocol_decl->getDefinition() != objc_protocol_decl;
+      if (wants(FieldIsForwardDeclaration)) {
+        writer.key("is_forward_declaration");
+        writer.boolean(is_forward_declaration);
+      }
+      if (!is_forward_declaration) {
+        writer.key("children");
+        serialize_decl_children(objc_protocol_decl);
+      }
+      add_protocols_if_any(objc_protocol_decl);
+    } break;
+    case clang::Decl::ObjCCategory: {
+      auto objc_category_decl = static_cast<const clang::ObjCCategoryDecl *>(decl);
+      auto class_interface = objc_category_decl->getClassInterface();
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(objc_category_decl->getName());
+      }
+      if (wants(FieldClassName)) {
+        writer.key("class_name");
+        writer.string(class_interface->getName());
+      }
+      writer.key("children");
+      serialize_decl_children(objc_category_decl);
+      add_protocols_if_any(objc_category_decl);
+    } break;
+    case clang::Decl::ObjCMethod:
+      write_ir(get_method_ir(static_cast<const clang::ObjCMethodDecl *>(decl)));
       break;
-    case clang::ObjCPropertyDecl::Required:
-      serialized_decl["property_implementation"] = "required";
+    case clang::Decl::Record: {
+      auto record_decl = static_cast<const clang::RecordDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(record_decl->getName());
+      }
+      auto is_forward_declaration = !record_decl->isCompleteDefinition();
+      if (wants(FieldIsForwardDeclaration)) {
+        writer.key("is_forward_declaration");
+        writer.boolean(is_forward_declaration);
+      }
+      if (!is_forward_declaration) {
+        writer.key("fields");
+        writer.start_array();
+        for (auto const field_decl : record_decl->fields()) {
+          serialize_decl(field_decl);
+        }
+        writer.end_array();
+      }
+      if (wants(FieldTagKind)) {
+        writer.key("tag_kind");
+        writer.string(record_decl->getKindName());
+      }
+    } break;
+    case clang::Decl::Enum: {
+      auto enum_decl = static_cast<const clang::EnumDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(enum_decl->getName());
+      }
+      if (wants(FieldIsClosed)) {
+        writer.key("is_closed");
+        writer.boolean(enum_decl->isClosed());
+      }
+      if (wants(FieldIsFlag)) {
+        writer.key("is_flag");
+        writer.boolean(enum_decl->hasAttr<clang::FlagEnumAttr>());
+      }
+      auto integer_type = enum_decl->getIntegerType();
+      if (!integer_type.isNull() && wants(FieldIntegerType)) {
+        writer.key("integer_type");
+        serialize_type(integer_type);
+      }
+      auto is_forward_declaration = !enum_decl->isCompleteDefinition();
+      if (wants(FieldIsForwardDeclaration)) {
+        writer.key("is_forward_declaration");
+        writer.boolean(is_forward_declaration);
+      }
+      if (!is_forward_declaration) {
+        writer.key("enumerators");
+        writer.start_array();
+        for (auto const enumerator_decl : enum_decl->enumerators()) {
+          // All enumerators should be instances of EnumConstantDecl
+          serialize_decl(enumerator_decl);
+        }
+        writer.end_array();
+      }
+    } break;
+    case clang::Decl::EnumConstant: {
+      auto enum_constant_decl = static_cast<const clang::EnumConstantDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(enum_constant_decl->getName());
+      }
+      auto qual_type = enum_constant_decl->getType();
+      // JSON's precision of numbers doesn't seem to be well defined so to be sure we keep the full
+      // precision store them as decimal strings.
+      if (!wants(FieldValue)) {
+        break;
+      }
+      if (qual_type->isSignedIntegerType()) {
+        writer.key("value");
+        writer.string(enum_constant_decl->getInitVal().toString(10, true));
+      } else if (qual_type->isUnsignedIntegerType()) {
+        writer.key("value");
+        writer.string(enum_constant_decl->getInitVal().toString(10, false));
+      } else {
+        llvm::raw_os_ostream err{std::cerr};
+        err << "\n";
+        err << "Could not find if ";
+        qual_type.print(err, context->getPrintingPolicy());
+        err << " is signed or not\n";
+      }
+    } break;
+    case clang::Decl::Field: {
+      auto field_decl = static_cast<const clang::FieldDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(field_decl->getName());
+      }
+      if (wants(FieldType)) {
+        writer.key("type");
+        serialize_type(field_decl->getType());
+      }
+      if (field_decl->isBitField() && wants(FieldBitWidth)) {
+        writer.key("bit_width");
+        writer.number_unsigned(field_decl->getBitWidthValue(*context));
+      }
+    } break;
+    case clang::Decl::Var: {
+      auto var_decl = static_cast<const clang::VarDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(var_decl->getName());
+      }
+      if (wants(FieldType)) {
+        writer.key("type");
+        serialize_type(var_decl->getType());
+      }
+    } break;
+    case clang::Decl::Function:
+      write_ir(get_function_ir(static_cast<const clang::FunctionDecl *>(decl)));
       break;
+    case clang::Decl::ObjCIvar: {
+      auto objc_ivar_decl = static_cast<const clang::ObjCIvarDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(objc_ivar_decl->getName());
+      }
+      if (wants(FieldType)) {
+        writer.key("type");
+        serialize_type(objc_ivar_decl->getType());
+      }
+    } break;
+    case clang::Decl::ObjCProperty: {
+      auto objc_property_decl = static_cast<const clang::ObjCPropertyDecl *>(decl);
+      if (wants(FieldName)) {
+        writer.key("name");
+        writer.string(objc_property_decl->getName());
+      }
+      if (wants(FieldType)) {
+        writer.key("type");
+        serialize_type(objc_property_decl->getType());
+      }
+      if (wants(FieldPropertyImplementation)) {
+        switch (objc_property_decl->getPropertyImplementation()) {
+        case clang::ObjCPropertyDecl::Optional:
+          writer.key("property_implementation");
+          writer.string("optional");
+          break;
+        case clang::ObjCPropertyDecl::Required:
+          writer.key("property_implementation");
+          writer.string("required");
+          break;
+        default:
+          break;
+        }
+      }
+      // TODO: Should get more info about property
+    } break;
     default:
-      break;
+      llvm_unreachable("decl kind not handled by is_serializable_decl");
     }
-    // TODO: Should get more info about property
-  } break;
-  default: {
-    llvm::raw_os_ostream err{std::cerr};
-    err << "Unknown decl kind " << decl->getDeclKindName() << " for:";
-    decl->print(err);
-    err << "\n";
-    return nullptr;
-  } break;
+
+    writer.end_object();
+    if (index != nullptr) {
+      // -index is only accepted when the output has the USRs, so they are already generated
+      index->add(usrs[decl_id(decl)], index_name(decl), index_start_offset);
+    }
+    return true;
   }
 
-  return serialized_decl;
-}
+  // Writes the start of the TranslationUnit object, up to the opening of its children array.
+  auto start_translation_unit(clang::TranslationUnitDecl const *tu_decl) -> void {
+    writer.start_object();
+    writer.key("kind");
+    write_enum(schema_decl_kinds, "TranslationUnit");
+    if (options.numeric_enums) {
+      write_schema();
+    }
+    // Lets consumers know they can rely on the tags being there
+    if (options.semantic_tags) {
+      writer.key("semantic_tags");
+      writer.boolean(true);
+    }
+    if (options.json_lines) {
+      writer.end_object();
+    } else {
+      writer.key("children");
+      writer.start_array();
+    }
+    // For some reason the implicit declarations at the start of TU contain id, SEL, Class, but not
+    // some others so add them by hand.
+    serialize_decl(tu_decl->getASTContext().getVaListTagDecl());
+    serialize_decl(tu_decl->getASTContext().getObjCInstanceTypeDecl());
+  }
 
-auto serialize_translation_unit_decl(clang::TranslationUnitDecl const *tu_decl) -> nlohmann::json {
-  nlohmann::json serialized_tu;
-  serialized_tu["kind"] = "TranslationUnit";
-  auto children = serialize_decl_children(tu_decl);
-  // For some reason the implicit declarations at the start of TU contain id, SEL, Class, but not
-  // some others so add them by hand.
-  children.insert(children.begin(),
-                  serialize_decl(tu_decl->getASTContext().getObjCInstanceTypeDecl()));
-  children.insert(children.begin(), serialize_decl(tu_decl->getASTContext().getVaListTagDecl()));
-  serialized_tu["children"] = children;
-  return serialized_tu;
-}
+  auto end_translation_unit() -> void {
+    if (!options.json_lines) {
+      writer.end_array();
+    }
+    if (options.intern_types) {
+      write_table([this] { write_type_table(); });
+    }
+    if (options.decl_ids) {
+      write_table([this] { write_usr_table(); });
+    }
+    if (options.file_ids) {
+      write_table([this] { write_file_table(); });
+    }
+    // Must be last as everything written before can add strings to it
+    if (string_table_writer) {
+      write_table([this] { string_table_writer->write_table(); });
+    }
+    if (!options.json_lines) {
+      writer.end_object();
+    }
+  }
 
-class JSONSerializerASTConsumer : public clang::ASTConsumer {
-public:
-  explicit JSONSerializerASTConsumer(clang::ASTContext *context) {}
-  virtual auto HandleTranslationUnit(clang::ASTContext &context) -> void override {
-    if (context.getDiagnostics().hasErrorOccurred()) {
+  auto usr_of(clang::Decl const *decl) -> llvm::StringRef { return usrs[decl_id(decl)]; }
+
+  auto type_depth_histogram() const -> llvm::ArrayRef<uint64_t> { return type_depth_counts; }
+
+  // The USRs of all the decls written or referenced so far.
+  auto written_usrs() const -> llvm::ArrayRef<llvm::StringRef> { return usrs; }
+
+  auto serialize_translation_unit_decl(clang::TranslationUnitDecl const *tu_decl) -> void {
+    top_level_filter->prepare(tu_decl);
+    start_translation_unit(tu_decl);
+    for (auto const child_decl : tu_decl->decls()) {
+      serialize_top_level_decl(child_decl);
+    }
+    end_translation_unit();
+  }
+
+private:
+  std::unique_ptr<StringTableWriter> string_table_writer;
+  JSONWriter &writer;
+  SerializerOptions options;
+  DeclIndexBuilder *index;
+  std::shared_ptr<TopLevelDeclFilter> top_level_filter;
+  std::unique_ptr<ModuleClassifier> module_classifier;
+  struct TypeFrame {
+    clang::Type const *type;
+    // Number of child types already handed out by write_type_object_part
+    unsigned children_done;
+  };
+
+  llvm::DenseMap<clang::Type const *, unsigned> type_ids;
+  // Index i is the number of type objects written with i levels of nesting
+  std::vector<uint64_t> type_depth_counts;
+  std::vector<clang::Type const *> interned_types;
+  // Generating a USR is costly and the same decls are referenced over and over, so the USR of
+  // each decl is generated only once. Ids are given per USR so that all the redeclarations of a
+  // decl share the same one.
+  llvm::DenseMap<clang::Decl const *, unsigned> decl_ids;
+  llvm::StringMap<unsigned> usr_ids;
+  std::vector<llvm::StringRef> usrs;
+  struct CachedFile {
+    unsigned file_id;
+    // #line directives can change the file name and line in the middle of a file
+    bool has_line_directives;
+  };
+  // Most decls come from a few large headers, so the file name only has to be found and hashed once
+  // per FileID.
+  llvm::DenseMap<clang::FileID, CachedFile> cached_files;
+  llvm::StringMap<unsigned> file_ids;
+  std::vector<llvm::StringRef> files;
+
+  auto decl_id(clang::Decl const *decl) -> unsigned {
+    auto found = decl_ids.find(decl);
+    if (found != decl_ids.end()) {
+      return found->second;
+    }
+    llvm::SmallString<128> usr;
+    clang::index::generateUSRForDecl(decl, usr);
+    auto next_id = static_cast<unsigned>(usrs.size());
+    auto inserted = usr_ids.insert(std::make_pair(usr, next_id));
+    if (inserted.second) {
+      // The keys of a StringMap never move so they can be referenced directly.
+      usrs.push_back(inserted.first->getKey());
+    }
+    decl_ids[decl] = inserted.first->second;
+    return inserted.first->second;
+  }
+
+  auto file_id(llvm::StringRef file_name) -> unsigned {
+    auto next_id = static_cast<unsigned>(files.size());
+    auto inserted = file_ids.insert(std::make_pair(file_name, next_id));
+    if (inserted.second) {
+      files.push_back(inserted.first->getKey());
+    }
+    return inserted.first->second;
+  }
+
+  auto write_location(clang::SourceManager const &source_manager, clang::SourceLocation location)
+      -> void {
+    unsigned file;
+    unsigned line;
+    if (!find_location(source_manager, location, file, line)) {
       return;
     }
-    auto json = serialize_translation_unit_decl(context.getTranslationUnitDecl());
-    std::cout << std::setw(4) << json << std::endl;
+    writer.key("location");
+    write_location_object(file, line);
   }
-};
 
-class JSONSerializerFrontendAction : public clang::ASTFrontendAction {
-public:
-  virtual auto CreateASTConsumer(clang::CompilerInstance &ci, StringRef file)
-      -> std::unique_ptr<clang::ASTConsumer> override {
-    return std::make_unique<JSONSerializerASTConsumer>(&ci.getASTContext());
+  // Only the locations, the other redeclarations can be found from them if needed.
+  auto write_redecl_locations(clang::SourceManager const &source_manager, clang::Decl const *decl)
+      -> void {
+    bool started = false;
+    for (auto const redecl : decl->redecls()) {
+      unsigned file;
+      unsigned line;
+      if (redecl == decl || !find_location(source_manager, redecl->getLocation(), file, line)) {
+        continue;
+      }
+      if (!started) {
+        writer.key("redecl_locations");
+        writer.start_array();
+        started = true;
+      }
+      write_location_object(file, line);
+    }
+    if (started) {
+      writer.end_array();
+    }
   }
-};
 
-static llvm::cl::OptionCategory JSONSerializerCategory("JSON serializer options");
+  auto find_location(clang::SourceManager const &source_manager, clang::SourceLocation location,
+                     unsigned &file, unsigned &line) -> bool {
+    if (location.isInvalid()) {
+      return false;
+    }
+    auto decomposed_loc = source_manager.getDecomposedExpansionLoc(location);
+    auto found = cached_files.find(decomposed_loc.first);
+    if (found != cached_files.end() && !found->second.has_line_directives) {
+      file = found->second.file_id;
+      line = source_manager.getLineNumber(decomposed_loc.first, decomposed_loc.second);
+    } else {
+      auto presumed_loc = source_manager.getPresumedLoc(location);
+      if (presumed_loc.isInvalid()) {
+        return false;
+      }
+      file = file_id(presumed_loc.getFilename());
+      line = presumed_loc.getLine();
+      if (found == cached_files.end()) {
+        bool invalid = false;
+        auto const &entry = source_manager.getSLocEntry(decomposed_loc.first, &invalid);
+        bool has_line_directives =
+            invalid || !entry.isFile() || entry.getFile().hasLineDirectives();
+        cached_files.insert({decomposed_loc.first, CachedFile{file, has_line_directives}});
+      }
+    }
+    return true;
+  }
 
-auto main(int argc, const char **argv) -> int {
-  clang::tooling::CommonOptionsParser op(argc, argv, JSONSerializerCategory);
-  clang::tooling::ClangTool tool(op.getCompilations(), op.getSourcePathList());
-  return tool.run(clang::tooling::newFrontendActionFactory<JSONSerializerFrontendAction>().get());
-}
\ No newline at end of file
+  auto write_location_object(unsigned file, unsigned line) -> void {
+    writer.start_object();
+    if (options.file_ids) {
+      writer.key("file_id");
+      writer.number_unsigned(file);
+    } else {
+      writer.key("file");
+      writer.string(files[file]);
+    }
+    writer.key("line");
+    writer.number_unsigned(line);
+    writer.end_object();
+  }
+
+  auto wants(DeclField field) const -> bool { return (options.decl_fields & field) != 0; }
+
+  // Methods are looked up by selector
+  static auto index_name(clang::Decl const *decl) -> std::string {
+    if (auto method_decl = llvm::dyn_cast<clang::ObjCMethodDecl>(decl)) {
+      return method_decl->getSelector().getAsString();
+    }
+    if (auto named_decl = llvm::dyn_cast<clang::NamedDecl>(decl)) {
+      return named_decl->getName();
+    }
+    return {};
+  }
+
+  auto write_decl_reference(char const *usr_key, char const *id_key, clang::Decl const *decl)
+      -> void {
+    if (options.decl_ids) {
+      writer.key(id_key);
+      writer.number_unsigned(decl_id(decl));
+    } else {
+      writer.key(usr_key);
+      writer.string(usrs[decl_id(decl)]);
+    }
+  }
+
+  auto serialize_type(clang::Type const *type) -> void {
+    if (options.intern_types) {
+      writer.number_unsigned(intern_type(type));
+      return;
+    }
+    serialize_type_object(type);
+  }
+
+  auto serialize_type(clang::QualType const &qual_type) -> void {
+    serialize_type(qual_type.getTypePtr());
+  }
+
+  auto intern_type(clang::Type const *type) -> unsigned {
+    auto inserted = type_ids.insert({type, static_cast<unsigned>(interned_types.size())});
+    if (inserted.second) {
+      interned_types.push_back(type);
+    }
+    return inserted.first->second;
+  }
+
+  // Iterative as block-heavy APIs have deeply nested types: the types being written are kept on an
+  // explicit stack, and each is written in parts separated by its child types.
+  auto serialize_type_object(clang::Type const *type) -> void {
+    llvm::SmallVector<TypeFrame, 16> stack;
+    stack.push_back(TypeFrame{type, 0});
+    size_t max_depth = 1;
+    while (!stack.empty()) {
+      auto child = write_type_object_part(stack.back());
+      if (child == nullptr) {
+        stack.pop_back();
+        continue;
+      }
+      ++stack.back().children_done;
+      if (options.intern_types) {
+        writer.number_unsigned(intern_type(child));
+        continue;
+      }
+      stack.push_back(TypeFrame{child, 0});
+      max_depth = std::max(max_depth, stack.size());
+    }
+    if (type_depth_counts.size() <= max_depth) {
+      type_depth_counts.resize(max_depth + 1);
+    }
+    ++type_depth_counts[max_depth];
+  }
+
+  // Writes the type object up to its next child type and returns that child, or writes the rest
+  // of the object and returns null.
+  auto write_type_object_part(TypeFrame const &frame) -> clang::Type const * {
+    auto type = frame.type;
+    auto children_done = frame.children_done;
+    if (children_done == 0) {
+      writer.start_object();
+      // {
+      //   llvm::raw_os_ostream err{std::cerr};
+      //   err << "Type class " << type->getTypeClassName() << "\n";
+      // }
+      writer.key("type_class");
+      if (type->getTypeClass() == clang::Type::Elaborated) {
+        write_enum(schema_type_classes, "ElaboratedType");
+      } else {
+        write_enum(schema_type_classes, type->getTypeClassName());
+      }
+      if (options.semantic_tags) {
+        write_semantic_tags(type);
+      }
+    }
+
+    switch (type->getTypeClass()) {
+    case clang::Type::ObjCObjectPointer: {
+      auto objc_obj_ptr_type = static_cast<const clang::ObjCObjectPointerType *>(type);
+      if (children_done == 0) {
+        writer.key("pointee");
+        return objc_obj_ptr_type->getPointeeType().getTypePtr();
+      }
+    } break;
+    case clang::Type::Builtin: {
+      auto builtin_type = static_cast<const clang::BuiltinType *>(type);
+      writer.key("name");
+      write_enum(schema_builtin_names, get_builtin_kind_name(builtin_type->getKind()));
+    } break;
+    case clang::Type::Pointer: {
+      auto ptr_type = static_cast<const clang::PointerType *>(type);
+      if (children_done == 0) {
+        writer.key("pointee");
+        return ptr_type->getPointeeType().getTypePtr();
+      }
+    } break;
+    case clang::Type::BlockPointer: {
+      auto block_ptr_type = static_cast<const clang::BlockPointerType *>(type);
+      if (children_done == 0) {
+        writer.key("pointee");
+        return block_ptr_type->getPointeeType().getTypePtr();
+      }
+    } break;
+    case clang::Type::ConstantArray: {
+      auto constant_array_type = static_cast<const clang::ConstantArrayType *>(type);
+      if (children_done == 0) {
+        writer.key("size");
+        writer.number_unsigned(constant_array_type->getSize().getZExtValue());
+        writer.key("element_type");
+        return constant_array_type->getElementType().getTypePtr();
+      }
+    } break;
+    case clang::Type::IncompleteArray: {
+      auto incomplete_array_type = static_cast<const clang::IncompleteArrayType *>(type);
+      if (children_done == 0) {
+        writer.key("element_type");
+        return incomplete_array_type->getElementType().getTypePtr();
+      }
+    } break;
+    case clang::Type::FunctionProto: {
+      auto function_proto_type = static_cast<const clang::FunctionProtoType *>(type);
+      if (children_done == 0) {
+        writer.key("is_variadic");
+        writer.boolean(function_proto_type->isVariadic());
+        writer.key("return_type");
+        return function_proto_type->getReturnType().getTypePtr();
+      }
+      // Then the params, the object of each one being closed when coming back from its type
+      auto param_index = children_done - 1;
+      if (param_index == 0) {
+        writer.key("params");
+        writer.start_array();
+      } else {
+        if (function_proto_type->isParamConsumed(param_index - 1)) {
+          writer.key("is_consumed");
+          writer.boolean(true);
+        }
+        writer.end_object();
+      }
+      if (param_index < function_proto_type->getNumParams()) {
+        writer.start_object();
+        writer.key("type");
+        return function_proto_type->getParamType(param_index).getTypePtr();
+      }
+      writer.end_array();
+    } break;
+    case clang::Type::FunctionNoProto: {
+      auto function_no_proto_type = static_cast<const clang::FunctionNoProtoType *>(type);
+      if (children_done == 0) {
+        writer.key("return_type");
+        return function_no_proto_type->getReturnType().getTypePtr();
+      }
+    } break;
+    case clang::Type::Paren: {
+      auto paren_type = static_cast<const clang::ParenType *>(type);
+      if (children_done == 0) {
+        writer.key("inner_type");
+        return paren_type->getInnerType().getTypePtr();
+      }
+    } break;
+    case clang::Type::Typedef: {
+      auto typedef_type = static_cast<const clang::TypedefType *>(type);
+      auto decl = typedef_type->getDecl();
+      writer.key("name");
+      writer.string(decl->getName());
+      write_decl_reference("decl_usr", "decl_id", decl);
+    } break;
+    case clang::Type::Decayed: {
+      auto decayed_type = static_cast<const clang::DecayedType *>(type);
+      if (children_done == 0) {
+        writer.key("pointee");
+        return decayed_type->getPointeeType().getTypePtr();
+      }
+    } break;
+    case clang::Type::Record: {
+      auto record_type = static_cast<const clang::RecordType *>(type);
+      // A struct can contain a reference to itself so we cannot expand the decl
+      write_decl_reference("decl_usr", "decl_id", record_type->getDecl());
+    } break;
+    case clang::Type::Enum: {
+      auto enum_type = static_cast<const clang::EnumType *>(type);
+      write_decl_reference("decl_usr", "decl_id", enum_type->getDecl());
+    } break;
+    case clang::Type::Elaborated: {
+      auto elaborated_type = static_cast<const clang::ElaboratedType *>(type);
+      if (children_done == 0) {
+        writer.key("keyword");
+        writer.string(clang::ElaboratedType::getKeywordName(elaborated_type->getKeyword()));
+        writer.key("named_type");
+        return elaborated_type->getNamedType().getTypePtr();
+      }
+    } break;
+    case clang::Type::Attributed: {
+      auto attributed_type = static_cast<const clang::AttributedType *>(type);
+      if (children_done == 0) {
+        writer.key("modified_type");
+        return attributed_type->getModifiedType().getTypePtr();
+      }
+      switch (attributed_type->getAttrKind()) {
+      case clang::AttributedType::Kind::attr_nonnull:
+        writer.key("nullability");
+        write_enum(schema_nullabilities, "nonnull");
+        break;
+      case clang::AttributedType::Kind::attr_nullable:
+        writer.key("nullability");
+        write_enum(schema_nullabilities, "nullable");
+        break;
+      case clang::AttributedType::Kind::attr_ns_returns_retained:
+        writer.key("ns_returns_retained");
+        writer.boolean(true);
+        break;
+      default:
+        break;
+      }
+    } break;
+    case clang::Type::ObjCTypeParam: {
+      auto objc_type_param = static_cast<const clang::ObjCTypeParamType *>(type);
+      auto decl = objc_type_param->getDecl();
+      writer.key("name");
+      writer.string(decl->getName());
+      if (!objc_type_param->getProtocols().empty()) {
+        writer.key("protocols");
+        writer.start_array();
+        for (auto const protocol : objc_type_param->getProtocols()) {
+          writer.string(protocol->getName());
+        }
+        writer.end_array();
+      }
+    } break;
+    case clang::Type::ObjCInterface:
+    case clang::Type::ObjCObject: {
+      auto objc_obj_type = static_cast<const clang::ObjCObjectType *>(type);
+      auto base_type = objc_obj_type->getBaseType();
+      // The children are the base type (only for id and Class), then the type arguments
+      unsigned base_count = base_type->isBuiltinType() ? 1 : 0;
+      if (children_done == 0 && base_count != 0) {
+        writer.key("base_type");
+        return base_type.getTypePtr();
+      }
+      auto type_args = objc_obj_type->getTypeArgs();
+      if (children_done == base_count) {
+        auto interface = objc_obj_type->getInterface();
+        if (interface != nullptr) {
+          write_decl_reference("interface_usr", "interface_id", interface);
+        }
+        if (!objc_obj_type->getProtocols().empty()) {
+          writer.key("protocols");
+          writer.start_array();
+          for (auto const protocol : objc_obj_type->getProtocols()) {
+            writer.string(protocol->getName());
+          }
+          writer.end_array();
+        }
+        if (type_args.empty()) {
+          break;
+        }
+        writer.key("type_args");
+        writer.start_array();
+      }
+      auto type_arg_index = children_done - base_count;
+      if (type_arg_index < type_args.size()) {
+        return type_args[type_arg_index].getTypePtr();
+      }
+      writer.end_array();
+    } break;
+    case clang::Type::Vector:
+    case clang::Type::ExtVector: {
+      auto vector_type = static_cast<const clang::VectorType *>(type);
+      if (children_done == 0) {
+        writer.key("num_elements");
+        writer.number_unsigned(vector_type->getNumElements());
+        writer.key("element_type");
+        return vector_type->getElementType().getTypePtr();
+      }
+    } break;
+    default: {
+      llvm::raw_os_ostream err{std::cerr};
+      err << "Unknown type class " << type->getTypeClassName() << "\n";
+    } break;
+    }
+
+    writer.end_object();
+    return nullptr;
+  }
+
+  template <size_t N>
+  auto write_enum(char const *const (&table)[N], llvm::StringRef value) -> void {
+    if (options.numeric_enums) {
+      auto index = schema_index(table, value);
+      if (index < N) {
+        writer.number_unsigned(index);
+        return;
+      }
+    }
+    writer.string(value);
+  }
+
+  // Written at the start so that it is known before the first decl, even in a stream
+  auto write_schema() -> void {
+    writer.key("schema");
+    writer.start_object();
+    writer.key("version");
+    writer.number_unsigned(numeric_enum_schema_version);
+    write_schema_table("kind", schema_decl_kinds);
+    write_schema_table("type_class", schema_type_classes);
+    write_schema_table("builtin_name", schema_builtin_names);
+    write_schema_table("method_family", schema_method_families);
+    write_schema_table("nullability", schema_nullabilities);
+    writer.end_object();
+  }
+
+  template <size_t N>
+  auto write_schema_table(llvm::StringRef key, char const *const (&table)[N]) -> void {
+    writer.key(key);
+    writer.start_array();
+    for (auto const value : table) {
+      writer.string(value);
+    }
+    writer.end_array();
+  }
+
+  auto write_semantic_tags(clang::Type const *type) -> void {
+    auto semantic_tag = get_semantic_tag(type);
+    if (semantic_tag != nullptr) {
+      writer.key("semantic");
+      writer.string(semantic_tag);
+    }
+    // The class behind all the sugar (typedefs, attributes, type arguments...)
+    auto canonical_type = type->getCanonicalTypeInternal();
+    if (auto const pointer_type = canonical_type->getAs<clang::ObjCObjectPointerType>()) {
+      if (auto const interface = pointer_type->getInterfaceDecl()) {
+        writer.key("canonical_class");
+        writer.string(interface->getName());
+      }
+    }
+  }
+
+  auto serialize_decl_children(clang::DeclContext const *decl_context) -> void {
+    writer.start_array();
+    for (auto const child_decl : decl_context->decls()) {
+      serialize_decl(child_decl);
+    }
+    writer.end_array();
+  }
+
+  template <class DeclType>
+  auto add_protocols_if_any(DeclType *decl) -> void {
+    if (decl->protocol_begin() == decl->protocol_end() || !wants(FieldProtocols)) {
+      return;
+    }
+    writer.key("protocols");
+    writer.start_array();
+    for (auto const protocol : decl->protocols()) {
+      writer.string(protocol->getName());
+    }
+    writer.end_array();
+  }
+
+  // Lets a RecordEncoder write the typed records with the writer of the serializer.
+  class IRSink {
+  public:
+    explicit IRSink(ASTSerializer &serializer) : serializer(serializer) {}
+
+    auto start_object() -> void { serializer.writer.start_object(); }
+    auto end_object() -> void { serializer.writer.end_object(); }
+    auto start_array() -> void { serializer.writer.start_array(); }
+    auto end_array() -> void { serializer.writer.end_array(); }
+    auto key(llvm::StringRef key) -> void { serializer.writer.key(key); }
+    auto boolean(bool value) -> void { serializer.writer.boolean(value); }
+
+    auto value(bool value) -> void { serializer.writer.boolean(value); }
+    auto value(llvm::StringRef value) -> void { serializer.writer.string(value); }
+    auto value(clang::QualType const &type) -> void { serializer.serialize_type(type); }
+    auto value(clang::ObjCMethodFamily family) -> void {
+      serializer.write_enum(schema_method_families, get_method_family_name(family));
+    }
+
+    auto mask_of(ParamIR const &) const -> uint32_t { return serializer.options.param_fields; }
+    auto mask_of(AttrsIR const &) const -> uint32_t { return 0; }
+
+  private:
+    ASTSerializer &serializer;
+  };
+
+  // Writes the fields of a decl record in the object of the decl.
+  template <class IR>
+  auto write_ir(IR const &ir) -> void {
+    IRSink sink{*this};
+    RecordEncoder<IRSink>{sink}.encode_fields(ir, options.decl_fields);
+  }
+
+  // With JSON Lines, each table is on its own line, in an object with a single key.
+  template <class Function> auto write_table(Function write_key_and_table) -> void {
+    if (options.json_lines) {
+      writer.start_object();
+    }
+    write_key_and_table();
+    if (options.json_lines) {
+      writer.end_object();
+    }
+  }
+
+  auto write_type_table() -> void {
+    writer.key("types");
+    writer.start_array();
+    // Serializing a type can intern new ones, so the size must be checked again at each iteration.
+    for (size_t i = 0; i < interned_types.size(); ++i) {
+      serialize_type_object(interned_types[i]);
+    }
+    writer.end_array();
+  }
+
+  auto write_file_table() -> void {
+    writer.key("files");
+    writer.start_array();
+    for (auto const file : files) {
+      writer.string(file);
+    }
+    writer.end_array();
+  }
+
+  auto write_usr_table() -> void {
+    writer.key("usrs");
+    writer.start_array();
+    for (auto const usr : usrs) {
+      writer.string(usr);
+    }
+    writer.end_array();
+  }
+};
+
+static llvm::cl::OptionCategory JSONSerializerCategory("JSON serializer options");
+
+static llvm::cl::opt<bool>
+    StreamOutput("stream",
+                 llvm::cl::desc("Write the JSON while walking the AST instead of building the "
+                                "whole document in memory first"),
+                 llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> PipelineOutput(
+    "pipeline",
+    llvm::cl::desc("Serialize top-level declarations as soon as they are parsed and write them "
+                   "from a background thread (implies -stream)"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<unsigned> PipelineQueueSize(
+    "pipeline-queue-size",
+    llvm::cl::desc("Maximum number of serialized chunks waiting to be written in -pipeline mode"),
+    llvm::cl::init(64), llvm::cl::cat(JSONSerializerCategory));
+
+enum class OutputFormat { JSON, CBOR, MessagePack, Flat };
+
+enum class ShardKey { USR, Module };
+
+static llvm::cl::opt<OutputFormat> Format(
+    "format", llvm::cl::desc("Output format"),
+    llvm::cl::values(clEnumValN(OutputFormat::JSON, "json", "JSON text (default)"),
+                     clEnumValN(OutputFormat::CBOR, "cbor", "CBOR (RFC 7049)"),
+                     clEnumValN(OutputFormat::MessagePack, "msgpack", "MessagePack"),
+                     clEnumValN(OutputFormat::Flat, "flat",
+                                "Flat binary records that can be mapped in memory and used "
+                                "without parsing (see include/flat_ast.hpp)")),
+    llvm::cl::init(OutputFormat::JSON), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> JSONLines(
+    "jsonl",
+    llvm::cl::desc("Write JSON Lines: a TranslationUnit header, then one line per top-level "
+                   "declaration as soon as it is serialized, then one line per table (implies "
+                   "-stream and -compact)"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> CompactOutput("compact",
+                                         llvm::cl::desc("Write JSON without any indentation"),
+                                         llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string> OutputPath("output",
+                                             llvm::cl::desc("Write the output to <file> instead "
+                                                            "of the standard output"),
+                                             llvm::cl::value_desc("file"), llvm::cl::init("-"),
+                                             llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string>
+    IndexPath("index",
+              llvm::cl::desc("Also write to <file> the offset and length in the output of the "
+                             "JSON of each decl, by USR and by name (implies -stream, see the "
+                             "query subcommand)"),
+              llvm::cl::value_desc("file"), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string> SplitModulesDirectory(
+    "split-modules",
+    llvm::cl::desc("Instead of the output, write the top-level decls of each module in "
+                   "<directory>/<module>.json, each file being a complete translation unit (the "
+                   "decls of headers in an unknown place are skipped with a warning)"),
+    llvm::cl::value_desc("directory"), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> SemanticTags(
+    "semantic-tags",
+    llvm::cl::desc("Tag the types that have a special meaning in Objective-C (objc_id, objc_sel, "
+                   "objc_class, instancetype, objc_bool, block) and write the class behind "
+                   "Objective-C object pointers"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> NumericEnums(
+    "numeric-enums",
+    llvm::cl::desc("Write kinds, type classes, builtin names, method families and nullabilities "
+                   "as their index in the tables of the \"schema\" written in the output"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<unsigned>
+    ShardCount("shards",
+               llvm::cl::desc("Instead of the output, split the top-level decls in <count> files "
+                              "by a stable hash, written in the -shard-directory"),
+               llvm::cl::value_desc("count"), llvm::cl::init(0),
+               llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string>
+    ShardDirectory("shard-directory",
+                   llvm::cl::desc("Directory where the shards and their manifest are written"),
+                   llvm::cl::value_desc("directory"), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<ShardKey> ShardBy(
+    "shard-by", llvm::cl::desc("What is hashed to choose the shard of a top-level decl"),
+    llvm::cl::values(clEnumValN(ShardKey::USR, "usr", "Its USR (default)"),
+                     clEnumValN(ShardKey::Module, "module", "Its module, keeping modules whole")),
+    llvm::cl::init(ShardKey::USR), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool>
+    Modules("modules",
+            llvm::cl::desc("Write the module (lowercased framework name) of each top-level decl, "
+                           "left out with a warning for headers in an unknown place"),
+            llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<unsigned> OutputBufferSize(
+    "output-buffer-size", llvm::cl::desc("Size in bytes of the buffer used for writing the output"),
+    llvm::cl::init(1 << 20), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> InternTypes(
+    "intern-types",
+    llvm::cl::desc("Write each distinct type once in a \"types\" table at the end of the "
+                   "translation unit and refer to it by index everywhere else"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool>
+    DeclIds("decl-ids",
+            llvm::cl::desc("Give each USR a numeric id, write the USRs once in a \"usrs\" table at "
+                           "the end of the translation unit and use the ids everywhere else"),
+            llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool>
+    FileIds("file-ids",
+            llvm::cl::desc("Write the file paths once in a \"files\" table at the end of the "
+                           "translation unit and only their index in locations"),
+            llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> StringTable(
+    "string-table",
+    llvm::cl::desc("Replace USRs, selectors, names and file paths by their index in a front-coded "
+                   "string table written at the end of the translation unit"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::list<std::string>
+    Fields("fields",
+           llvm::cl::desc("Only write these keys of the decls, for example "
+                          "kind,name,usr,selector,params.type,return_type (kind, children, fields "
+                          "and enumerators are always written)"),
+           llvm::cl::CommaSeparated, llvm::cl::value_desc("key,..."),
+           llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string> IncludePathRegex(
+    "include-path-regex",
+    llvm::cl::desc("Only write the top-level decls from files whose path matches <regex>"),
+    llvm::cl::value_desc("regex"), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<std::string> ExcludePathRegex(
+    "exclude-path-regex",
+    llvm::cl::desc("Do not write the top-level decls from files whose path matches <regex>"),
+    llvm::cl::value_desc("regex"), llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::list<std::string>
+    Frameworks("frameworks",
+               llvm::cl::desc("Only write the top-level decls from headers of these frameworks "
+                              "(and from the system headers they need)"),
+               llvm::cl::CommaSeparated, llvm::cl::value_desc("name,..."),
+               llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool>
+    Dedup("dedup",
+          llvm::cl::desc("Only write one declaration per top-level decl: its definition, or its "
+                         "first declaration if it has no definition"),
+          llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> RedeclLocations(
+    "redecl-locations",
+    llvm::cl::desc("With -dedup, write the locations of the other declarations of each decl"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool> ReachableOnly(
+    "reachable-only",
+    llvm::cl::desc("Only write the Objective-C interfaces, protocols and categories, and the "
+                   "typedefs, records and enums their methods use"),
+    llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::list<std::string>
+    Roots("roots",
+          llvm::cl::desc("Only write these classes and protocols (prefixed by @), their super "
+                         "classes, protocols and categories, and what their methods use. The "
+                         "other classes used only get forward declarations"),
+          llvm::cl::CommaSeparated, llvm::cl::value_desc("name,@protocol,..."),
+          llvm::cl::cat(JSONSerializerCategory));
+
+static llvm::cl::opt<bool>
+    PrintStats("stats",
+               llvm::cl::desc("Print to stderr the size of the output and the time it took"),
+               llvm::cl::cat(JSONSerializerCategory));
+
+auto indent_width() -> unsigned { return CompactOutput || JSONLines ? 0 : 4; }
+
+auto serializer_options() -> SerializerOptions {
+  SerializerOptions options;
+  // The flat format stores each type once anyway, so interning just saves work.
+  options.intern_types = InternTypes || Format == OutputFormat::Flat;
+  options.decl_ids = DeclIds;
+  options.file_ids = FileIds;
+  options.string_table = StringTable;
+  options.json_lines = JSONLines;
+  options.include_path_regex = IncludePathRegex;
+  options.exclude_path_regex = ExcludePathRegex;
+  options.frameworks.assign(Frameworks.begin(), Frameworks.end());
+  options.reachable_only = ReachableOnly;
+  options.roots.assign(Roots.begin(), Roots.end());
+  options.dedup = Dedup;
+  options.redecl_locations = RedeclLocations;
+  options.modules = Modules;
+  options.semantic_tags = SemanticTags;
+  options.numeric_enums = NumericEnums;
+  if (!Fields.empty()) {
+    // Already validated by main()
+    parse_field_list(Fields, options);
+  }
+  return options;
+}
+
+class Stopwatch {
+public:
+  auto elapsed_ms() const -> double {
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start)
+        .count();
+  }
+
+private:
+  std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+};
+
+// Serializes the top-level decls as clang hands them over, while the rest of the file is still
+// being parsed. The serialized text is cut in one chunk per decl group and written by a background
+// thread.
+//
+// A decl serialized early can differ slightly from what the whole TU would give (for example
+// is_referenced is only true if the decl was referenced before being handed over).
+class PipelinedSerializer {
+public:
+  explicit PipelinedSerializer(llvm::raw_ostream &out)
+      : chunk_stream(chunk), writer(chunk_stream, indent_width()),
+        serializer(writer, serializer_options()), background_writer(out, PipelineQueueSize) {}
+
+  auto type_depth_histogram() const -> llvm::ArrayRef<uint64_t> {
+    return serializer.type_depth_histogram();
+  }
+
+  auto handle_top_level_decls(clang::DeclGroupRef group) -> void {
+    if (failed || group.isNull()) {
+      return;
+    }
+    if ((*group.begin())->getASTContext().getDiagnostics().hasErrorOccurred()) {
+      fail();
+      return;
+    }
+    for (auto const decl : group) {
+      // Decls inside an other decl are serialized with their parent.
+      if (!decl->getDeclContext()->isTranslationUnit()) {
+        continue;
+      }
+      start_if_needed(decl->getASTContext().getTranslationUnitDecl());
+      if (serialized_decls.insert(decl).second) {
+        serializer.serialize_top_level_decl(decl);
+      }
+    }
+    flush_chunk();
+  }
+
+  // On error, the output is left unfinished, without even its closing brace, instead of being a
+  // well-formed but truncated document. The tool exits with an error status anyway.
+  auto finish(clang::TranslationUnitDecl const *tu_decl, bool has_error_occurred) -> void {
+    if (failed || has_error_occurred) {
+      fail();
+      return;
+    }
+    start_if_needed(tu_decl);
+    // Implicit decls are never handed over, and neither are the ones declared inside an
+    // Objective-C container but belonging to the TU.
+    for (auto const child_decl : tu_decl->decls()) {
+      if (serialized_decls.insert(child_decl).second) {
+        serializer.serialize_top_level_decl(child_decl);
+      }
+    }
+    serializer.end_translation_unit();
+    flush_chunk();
+    background_writer.finish();
+  }
+
+private:
+  std::string chunk;
+  llvm::raw_string_ostream chunk_stream;
+  JSONTextWriter writer;
+  ASTSerializer serializer;
+  BackgroundWriter background_writer;
+  llvm::DenseSet<clang::Decl const *> serialized_decls;
+  bool started = false;
+  bool failed = false;
+
+  // Nothing more is written once an error has occurred.
+  auto fail() -> void {
+    failed = true;
+    background_writer.discard();
+  }
+
+  auto start_if_needed(clang::TranslationUnitDecl const *tu_decl) -> void {
+    if (started) {
+      return;
+    }
+    started = true;
+    auto &context = tu_decl->getASTContext();
+    serialized_decls.insert(context.getVaListTagDecl());
+    serialized_decls.insert(context.getObjCInstanceTypeDecl());
+    serializer.start_translation_unit(tu_decl);
+  }
+
+  auto flush_chunk() -> void {
+    chunk_stream.flush();
+    if (chunk.empty()) {
+      return;
+    }
+    background_writer.push(std::move(chunk));
+    chunk.clear();
+  }
+};
+
+// 64-bit FNV-1a, stable across runs and platforms so that a decl always lands in the same shard.
+auto fnv1a_hash(llvm::StringRef data) -> uint64_t {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto const c : data) {
+    hash ^= static_cast<unsigned char>(c);
+    hash *= 0x100000001b3;
+  }
+  return hash;
+}
+
+// Splits the top-level decls in several files in a directory: one per module (-split-modules), or
+// a fixed number of shards chosen by hash (-shards). Every file is a complete translation unit
+// with its own tables, so that each can be loaded independently. The AST is only walked from the
+// main thread, but each file is written by its own background thread.
+//
+// A manifest.json is also written, listing for each file the USRs of the top-level decls it
+// defines (those of the definitions, or of the first declarations when there is no definition, not
+// of forward declarations), and the USRs it references that are defined in an other file:
+//   {"files": [{"name": ..., "file": ..., "defines": [usr...],
+//               "references": [{"usr": ..., "file": ...}...]}...]}
+class SplitSerializer {
+public:
+  // A shard count of 0 means one file per module.
+  SplitSerializer(llvm::StringRef directory, unsigned shard_count, ShardKey shard_key)
+      : directory(directory), shard_count(shard_count), shard_key(shard_key),
+        options(serializer_options()),
+        top_level_filter(std::make_shared<TopLevelDeclFilter>(options)) {}
+
+  // Returns the number of bytes written in all the files.
+  auto serialize(clang::TranslationUnitDecl const *tu_decl) -> uint64_t {
+    auto error_code = llvm::sys::fs::create_directories(directory);
+    if (error_code) {
+      std::cerr << "Could not create " << directory << ": " << error_code.message() << "\n";
+      return 0;
+    }
+    top_level_filter->prepare(tu_decl);
+    for (auto const child_decl : tu_decl->decls()) {
+      // Checked first so that no file is created for a part without any decl
+      if (!top_level_filter->accepts(child_decl) || !is_serializable_decl(child_decl)) {
+        continue;
+      }
+      auto part = part_of(child_decl);
+      // The module could not be found, a warning has been reported
+      if (part.empty()) {
+        continue;
+      }
+      auto output = output_for(part, tu_decl);
+      if (output != nullptr && output->serializer.serialize_decl(child_decl)) {
+        // Redeclarations share the same USR, only the definition (or the first declaration when
+        // there is none) defines it, not a forward declaration in an other file
+        if (get_representative_decl(child_decl) == child_decl) {
+          add_definition(output->serializer.usr_of(child_decl), output);
+        }
+        output->flush_chunk();
+      }
+    }
+    uint64_t bytes_written = 0;
+    for (auto &entry : outputs) {
+      auto &output = *entry.getValue();
+      output.serializer.end_translation_unit();
+      output.flush_chunk();
+      output.background_writer.finish();
+      bytes_written += output.file->tell();
+    }
+    return bytes_written + write_manifest();
+  }
+
+  // The sum of the ones of all the files.
+  auto type_depth_histogram() const -> std::vector<uint64_t> {
+    std::vector<uint64_t> histogram;
+    for (auto const &entry : outputs) {
+      auto output_histogram = entry.getValue()->serializer.type_depth_histogram();
+      if (histogram.size() < output_histogram.size()) {
+        histogram.resize(output_histogram.size());
+      }
+      for (size_t depth = 0; depth < output_histogram.size(); ++depth) {
+        histogram[depth] += output_histogram[depth];
+      }
+    }
+    return histogram;
+  }
+
+private:
+  struct Output {
+    Output(llvm::StringRef name, std::unique_ptr<llvm::raw_fd_ostream> file,
+           SerializerOptions const &options, std::shared_ptr<TopLevelDeclFilter> top_level_filter)
+        : name(name), file(std::move(file)), chunk_stream(chunk),
+          writer(chunk_stream, indent_width()),
+          serializer(writer, options, nullptr, std::move(top_level_filter)),
+          background_writer(*this->file, PipelineQueueSize) {}
+
+    std::string name;
+    std::unique_ptr<llvm::raw_fd_ostream> file;
+    std::string chunk;
+    llvm::raw_string_ostream chunk_stream;
+    JSONTextWriter writer;
+    ASTSerializer serializer;
+    BackgroundWriter background_writer;
+    std::vector<llvm::StringRef> defined_usrs;
+
+    auto flush_chunk() -> void {
+      chunk_stream.flush();
+      if (chunk.empty()) {
+        return;
+      }
+      background_writer.push(std::move(chunk));
+      chunk.clear();
+    }
+  };
+
+  std::string directory;
+  unsigned shard_count;
+  ShardKey shard_key;
+  SerializerOptions options;
+  std::shared_ptr<TopLevelDeclFilter> top_level_filter;
+  ModuleClassifier module_classifier;
+  llvm::StringMap<std::unique_ptr<Output>> outputs;
+  llvm::StringMap<Output const *> output_by_usr;
+
+  auto add_definition(llvm::StringRef usr, Output *output) -> void {
+    auto inserted = output_by_usr.insert(std::make_pair(usr, output));
+    if (inserted.second) {
+      output->defined_usrs.push_back(usr);
+      return;
+    }
+    auto owner = inserted.first->getValue();
+    if (owner != output) {
+      std::cerr << usr.str() << " is defined in both " << owner->name << " and " << output->name
+                << ", the manifest only lists it in " << owner->name << "\n";
+    }
+  }
+
+  auto part_of(clang::Decl const *decl) -> std::string {
+    if (shard_count == 0) {
+      return module_classifier.module_of(decl).str();
+    }
+    llvm::SmallString<128> usr;
+    llvm::StringRef key;
+    if (shard_key == ShardKey::Module) {
+      key = module_classifier.module_of(decl);
+      if (key.empty()) {
+        return {};
+      }
+    } else {
+      clang::index::generateUSRForDecl(decl, usr);
+      key = usr;
+    }
+    return "shard-" + std::to_string(fnv1a_hash(key) % shard_count);
+  }
+
+  // Opens the file of the part the first time it is needed. Returns null if it cannot be opened.
+  auto output_for(llvm::StringRef name, clang::TranslationUnitDecl const *tu_decl) -> Output * {
+    auto found = outputs.find(name);
+    if (found != outputs.end()) {
+      return found->getValue().get();
+    }
+    llvm::SmallString<256> path{directory};
+    llvm::sys::path::append(path, name + ".json");
+    std::error_code error_code;
+    auto file = std::make_unique<llvm::raw_fd_ostream>(path, error_code, llvm::sys::fs::F_None);
+    std::unique_ptr<Output> output;
+    if (error_code) {
+      std::cerr << "Could not open " << path.str().str() << ": " << error_code.message() << "\n";
+    } else {
+      output = std::make_unique<Output>(name, std::move(file), options, top_level_filter);
+      output->serializer.start_translation_unit(tu_decl);
+    }
+    // Also remembered when it could not be opened so that the error is only reported once
+    auto inserted = outputs.insert(std::make_pair(name, std::move(output)));
+    return inserted.first->getValue().get();
+  }
+
+  // Returns the number of bytes written.
+  auto write_manifest() const -> uint64_t {
+    std::vector<Output const *> sorted_outputs;
+    for (auto const &entry : outputs) {
+      auto output = entry.getValue().get();
+      if (output != nullptr) {
+        sorted_outputs.push_back(output);
+      }
+    }
+    std::sort(sorted_outputs.begin(), sorted_outputs.end(),
+              [](Output const *a, Output const *b) { return a->name < b->name; });
+
+    llvm::SmallString<256> path{directory};
+    llvm::sys::path::append(path, "manifest.json");
+    std::error_code error_code;
+    llvm::raw_fd_ostream out{path, error_code, llvm::sys::fs::F_None};
+    if (error_code) {
+      std::cerr << "Could not open " << path.str().str() << ": " << error_code.message() << "\n";
+      return 0;
+    }
+    JSONTextWriter writer{out, indent_width()};
+    writer.start_object();
+    writer.key("files");
+    writer.start_array();
+    for (auto const output : sorted_outputs) {
+      writer.start_object();
+      writer.key("name");
+      writer.string(output->name);
+      writer.key("file");
+      writer.string(output->name + ".json");
+      writer.key("defines");
+      writer.start_array();
+      for (auto const usr : output->defined_usrs) {
+        writer.string(usr);
+      }
+      writer.end_array();
+      // Every USR the serializer of the file wrote, the ones of its own decls included
+      writer.key("references");
+      writer.start_array();
+      for (auto const usr : output->serializer.written_usrs()) {
+        auto found = output_by_usr.find(usr);
+        if (found == output_by_usr.end() || found->getValue() == output) {
+          continue;
+        }
+        writer.start_object();
+        writer.key("usr");
+        writer.string(usr);
+        writer.key("file");
+        writer.string(found->getValue()->name + ".json");
+        writer.end_object();
+      }
+      writer.end_array();
+      writer.end_object();
+    }
+    writer.end_array();
+    writer.end_object();
+    out.flush();
+    return out.tell();
+  }
+};
+
+class JSONSerializerASTConsumer : public clang::ASTConsumer {
+public:
+  explicit JSONSerializerASTConsumer(llvm::raw_fd_ostream &out)
+      : out(out), pipeline_start_offset(out.tell()) {
+    if (PipelineOutput) {
+      pipeline = std::make_unique<PipelinedSerializer>(out);
+    }
+  }
+  virtual auto HandleTopLevelDecl(clang::DeclGroupRef group) -> bool override {
+    if (pipeline) {
+      pipeline->handle_top_level_decls(group);
+    }
+    return true;
+  }
+  virtual auto HandleTranslationUnit(clang::ASTContext &context) -> void override {
+    // The background writer of the pipeline owns the output until finish() joins it
+    if (pipeline) {
+      pipeline->finish(context.getTranslationUnitDecl(),
+                       context.getDiagnostics().hasErrorOccurred());
+      report_stats(out.tell() - pipeline_start_offset, "parsing, serializing and writing");
+      report_type_depths(pipeline->type_depth_histogram());
+      return;
+    }
+    auto start_offset = out.tell();
+    if (context.getDiagnostics().hasErrorOccurred()) {
+      return;
+    }
+    Stopwatch stopwatch;
+    if (!SplitModulesDirectory.empty() || ShardCount != 0) {
+      SplitSerializer serializer{ShardCount != 0 ? ShardDirectory : SplitModulesDirectory,
+                                 ShardCount, ShardBy};
+      auto bytes_written = serializer.serialize(context.getTranslationUnitDecl());
+      report_stats(bytes_written, "serializing and writing", stopwatch);
+      report_type_depths(serializer.type_depth_histogram());
+    } else if (Format == OutputFormat::Flat) {
+      FlatASTWriter writer;
+      ASTSerializer serializer{writer, serializer_options()};
+      serializer.serialize_translation_unit_decl(context.getTranslationUnitDecl());
+      writer.write(out);
+      out.flush();
+      report_stats(out.tell() - start_offset, "serializing and writing", stopwatch);
+      report_type_depths(serializer.type_depth_histogram());
+    } else if (!IndexPath.empty()) {
+      JSONTextWriter writer{out, indent_width()};
+      DeclIndexBuilder index{writer};
+      ASTSerializer serializer{writer, serializer_options(), &index};
+      serializer.serialize_translation_unit_decl(context.getTranslationUnitDecl());
+      write_index(index);
+      out.flush();
+      report_stats(out.tell() - start_offset, "serializing and writing", stopwatch);
+      report_type_depths(serializer.type_depth_histogram());
+    } else if (StreamOutput || JSONLines) {
+      JSONTextWriter writer{out, indent_width()};
+      ASTSerializer serializer{writer, serializer_options()};
+      serializer.serialize_translation_unit_decl(context.getTranslationUnitDecl());
+      out.flush();
+      report_stats(out.tell() - start_offset, "serializing and writing", stopwatch);
+      report_type_depths(serializer.type_depth_histogram());
+    } else {
+      JSONDOMWriter dom_writer;
+      ASTSerializer serializer{dom_writer, serializer_options()};
+      serializer.serialize_translation_unit_decl(context.getTranslationUnitDecl());
+      report_stats(0, "building the document", stopwatch);
+      report_type_depths(serializer.type_depth_histogram());
+      Stopwatch write_stopwatch;
+      switch (Format) {
+      case OutputFormat::JSON: {
+        JSONTextWriter writer{out, indent_width()};
+        write_json_document(dom_writer.document(), writer);
+      } break;
+      case OutputFormat::CBOR:
+        write_cbor_document(dom_writer.document(), out);
+        break;
+      case OutputFormat::MessagePack:
+        write_msgpack_document(dom_writer.document(), out);
+        break;
+      case OutputFormat::Flat:
+        llvm_unreachable("the flat format does not need the document");
+      }
+      out.flush();
+      report_stats(out.tell() - start_offset, "writing", write_stopwatch);
+      report_document_memory(dom_writer.memory());
+      Stopwatch release_stopwatch;
+      dom_writer.release();
+      report_stats(0, "releasing the document", release_stopwatch);
+    }
+  }
+
+private:
+  llvm::raw_fd_ostream &out;
+  // Taken before the pipeline starts writing
+  uint64_t pipeline_start_offset;
+  std::unique_ptr<PipelinedSerializer> pipeline;
+  // Created with the consumer, so before the parsing starts
+  Stopwatch parse_stopwatch;
+
+  auto write_index(DeclIndexBuilder &index) const -> void {
+    std::error_code error_code;
+    llvm::raw_fd_ostream index_out{IndexPath, error_code, llvm::sys::fs::F_None};
+    if (error_code) {
+      std::cerr << "Could not open " << IndexPath << ": " << error_code.message() << "\n";
+      return;
+    }
+    index.write(index_out);
+  }
+
+  auto report_stats(uint64_t bytes_written, char const *step) const -> void {
+    report_stats(bytes_written, step, parse_stopwatch);
+  }
+
+  auto report_stats(uint64_t bytes_written, char const *step, Stopwatch const &stopwatch) const
+      -> void {
+    if (!PrintStats) {
+      return;
+    }
+    llvm::errs() << "json_serializer: " << llvm::format("%.1f", stopwatch.elapsed_ms())
+                 << " ms for " << step;
+    if (bytes_written != 0) {
+      llvm::errs() << ", " << bytes_written << " bytes written";
+    }
+    llvm::errs() << "\n";
+  }
+
+  // Each arena allocation would have been a malloc, and a free on destruction, without the arena.
+  auto report_document_memory(JSONArena const &arena) const -> void {
+    if (!PrintStats) {
+      return;
+    }
+    llvm::errs() << "json_serializer: document: " << arena.allocation_count() << " allocations, "
+                 << arena.bytes_allocated() << " bytes in " << arena.slab_count() << " slabs\n";
+  }
+
+  // Deeply nested types are the slowest to write, this shows how many there are.
+  auto report_type_depths(llvm::ArrayRef<uint64_t> histogram) const -> void {
+    if (!PrintStats || histogram.empty()) {
+      return;
+    }
+    llvm::errs() << "json_serializer: type objects by nesting depth:";
+    for (size_t depth = 0; depth < histogram.size(); ++depth) {
+      if (histogram[depth] != 0) {
+        llvm::errs() << " " << depth << ":" << histogram[depth];
+      }
+    }
+    llvm::errs() << "\n";
+  }
+};
+
+class JSONSerializerFrontendAction : public clang::ASTFrontendAction {
+public:
+  explicit JSONSerializerFrontendAction(llvm::raw_fd_ostream &out) : out(out) {}
+  virtual auto CreateASTConsumer(clang::CompilerInstance &ci, StringRef file)
+      -> std::unique_ptr<clang::ASTConsumer> override {
+    return std::make_unique<JSONSerializerASTConsumer>(out);
+  }
+
+private:
+  llvm::raw_fd_ostream &out;
+};
+
+class JSONSerializerFrontendActionFactory : public clang::tooling::FrontendActionFactory {
+public:
+  explicit JSONSerializerFrontendActionFactory(llvm::raw_fd_ostream &out) : out(out) {}
+  virtual auto create() -> clang::FrontendAction * override {
+    return new JSONSerializerFrontendAction(out);
+  }
+
+private:
+  llvm::raw_fd_ostream &out;
+};
+
+// json_serializer query [--index <file>] (--usr <usr> | --name <name> | --prefix <prefix>) <output>
+// Prints the JSON of the matching decls of an output written with -index, one per line, reading
+// only what is needed.
+auto run_query(int argc, const char **argv) -> int {
+  char const *usage = "usage: json_serializer query [--index <file>] (--usr <usr> | --name <name> "
+                      "| --prefix <selector or name prefix>) <output>\n";
+  llvm::StringRef index_path;
+  llvm::StringRef lookup_kind;
+  llvm::StringRef lookup_key;
+  llvm::StringRef output_path;
+  for (int i = 2; i < argc; ++i) {
+    llvm::StringRef arg = argv[i];
+    if (arg == "--index" || arg == "--usr" || arg == "--name" || arg == "--prefix") {
+      if (i + 1 == argc) {
+        std::cerr << usage;
+        return 1;
+      }
+      if (arg == "--index") {
+        index_path = argv[++i];
+      } else {
+        lookup_kind = arg;
+        lookup_key = argv[++i];
+      }
+    } else if (output_path.empty()) {
+      output_path = arg;
+    } else {
+      std::cerr << usage;
+      return 1;
+    }
+  }
+  if (lookup_kind.empty() || output_path.empty()) {
+    std::cerr << usage;
+    return 1;
+  }
+  std::string default_index_path = (output_path + ".index").str();
+  if (index_path.empty()) {
+    index_path = default_index_path;
+  }
+
+  auto index_buffer = llvm::MemoryBuffer::getFile(index_path);
+  if (!index_buffer) {
+    std::cerr << "Could not read " << index_path.str() << ": " << index_buffer.getError().message()
+              << "\n";
+    return 1;
+  }
+  DeclIndexReader index;
+  if (!index.load(std::move(*index_buffer))) {
+    std::cerr << index_path.str() << " is not a valid index\n";
+    return 1;
+  }
+  auto entries = lookup_kind == "--usr"
+                     ? index.find_usr(lookup_key)
+                     : lookup_kind == "--name" ? index.find_name(lookup_key)
+                                               : index.find_name_prefix(lookup_key);
+  for (auto const &entry : entries) {
+    auto slice = llvm::MemoryBuffer::getFileSlice(output_path, entry.length, entry.offset);
+    if (!slice) {
+      std::cerr << "Could not read " << output_path.str() << ": " << slice.getError().message()
+                << "\n";
+      return 1;
+    }
+    llvm::outs() << (*slice)->getBuffer() << "\n";
+  }
+  return entries.empty() ? 1 : 0;
+}
+
+auto main(int argc, const char **argv) -> int {
+  // Dispatched by hand as CommonOptionsParser expects source files
+  if (argc >= 2 && llvm::StringRef(argv[1]) == "query") {
+    return run_query(argc, argv);
+  }
+  clang::tooling::CommonOptionsParser op(argc, argv, JSONSerializerCategory);
+  if ((Format == OutputFormat::CBOR || Format == OutputFormat::MessagePack) &&
+      (StreamOutput || PipelineOutput)) {
+    std::cerr << "CBOR and MessagePack need the whole document: they cannot be used with -stream "
+                 "or -pipeline\n";
+    return 1;
+  }
+  if (Format != OutputFormat::JSON && JSONLines) {
+    std::cerr << "-jsonl can only be used with the JSON format\n";
+    return 1;
+  }
+  if (!Fields.empty()) {
+    SerializerOptions options;
+    auto unknown_field = parse_field_list(Fields, options);
+    if (unknown_field) {
+      std::cerr << "Unknown field " << *unknown_field << " given to -fields\n";
+      return 1;
+    }
+    if (!IndexPath.empty() && (options.decl_fields & FieldUSR) == 0) {
+      std::cerr << "-index looks decls up by USR: -fields must include usr\n";
+      return 1;
+    }
+  }
+  for (auto const &regex : {IncludePathRegex.getValue(), ExcludePathRegex.getValue()}) {
+    std::string error;
+    if (!regex.empty() && !llvm::Regex(regex).isValid(error)) {
+      std::cerr << "Invalid regex " << regex << ": " << error << "\n";
+      return 1;
+    }
+  }
+  if (!IndexPath.empty() && (Format != OutputFormat::JSON || PipelineOutput)) {
+    std::cerr << "-index can only be used with the JSON format, and not with -pipeline\n";
+    return 1;
+  }
+  if (!SplitModulesDirectory.empty() &&
+      (Format != OutputFormat::JSON || PipelineOutput || !IndexPath.empty())) {
+    std::cerr << "-split-modules can only be used with the JSON format, and not with -pipeline or "
+                 "-index\n";
+    return 1;
+  }
+  if (ShardCount != 0 && (ShardDirectory.empty() || !SplitModulesDirectory.empty() ||
+                          Format != OutputFormat::JSON || PipelineOutput || !IndexPath.empty())) {
+    std::cerr << "-shards needs a -shard-directory, can only be used with the JSON format, and not "
+                 "with -split-modules, -pipeline or -index\n";
+    return 1;
+  }
+  if (RedeclLocations && !Dedup) {
+    std::cerr << "-redecl-locations can only be used with -dedup\n";
+    return 1;
+  }
+  if (Dedup && PipelineOutput) {
+    std::cerr << "-dedup needs the whole translation unit to find definitions: it cannot be used "
+                 "with -pipeline\n";
+    return 1;
+  }
+  if ((ReachableOnly || !Roots.empty()) && PipelineOutput) {
+    std::cerr << "-reachable-only and -roots need the whole translation unit: they cannot be used "
+                 "with -pipeline\n";
+    return 1;
+  }
+  if (Format == OutputFormat::Flat && PipelineOutput) {
+    std::cerr << "The flat format cannot be used with -pipeline\n";
+    return 1;
+  }
+  if (Format == OutputFormat::Flat && NumericEnums) {
+    std::cerr << "The flat format already stores these values in its string table: it cannot be "
+                 "used with -numeric-enums\n";
+    return 1;
+  }
+  if (Format == OutputFormat::Flat && (DeclIds || FileIds || StringTable)) {
+    std::cerr << "The flat format has its own string table: it cannot be used with -decl-ids, "
+                 "-file-ids or -string-table\n";
+    return 1;
+  }
+  if (Format == OutputFormat::Flat && (SemanticTags || Modules || RedeclLocations)) {
+    std::cerr << "The flat format has no room for semantic tags, modules or redeclaration "
+                 "locations: it cannot be used with -semantic-tags, -modules or "
+                 "-redecl-locations\n";
+    return 1;
+  }
+  clang::tooling::ClangTool tool(op.getCompilations(), op.getSourcePathList());
+  // "-" is the standard output. Whatever the destination, writes go through our own large buffer
+  // instead of iostreams.
+  std::error_code error_code;
+  llvm::raw_fd_ostream out{OutputPath, error_code, llvm::sys::fs::F_None};
+  if (error_code) {
+    std::cerr << "Could not open " << OutputPath << ": " << error_code.message() << "\n";
+    return 1;
+  }
+  out.SetBufferSize(OutputBufferSize);
+  JSONSerializerFrontendActionFactory factory{out};
+  return tool.run(&factory);
+}
@@ -0,0 +1,325 @@
+#ifndef CHOCOLATIER_JSON_WRITER_HPP
+#define CHOCOLATIER_JSON_WRITER_HPP
+
+#pragma clang diagnostic push
+#pragma clang diagnostic ignored "-Wcovered-switch-default"
+#include "json.hpp"
+#pragma clang diagnostic pop
+
+#include "flat_map.hpp"
+#include "json_arena.hpp"
+#include "text_encoding.hpp"
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+// Receives a document as a stream of SAX-style events, in the same vocabulary as nlohmann's SAX
+// interface. The serializer only ever talks to this interface so the same AST walk can either
+// build a DOM or stream text directly to the output.
+class JSONWriter {
+public:
+  virtual ~JSONWriter() = default;
+
+  virtual auto start_object() -> void = 0;
+  virtual auto end_object() -> void = 0;
+  virtual auto start_array() -> void = 0;
+  virtual auto end_array() -> void = 0;
+  virtual auto key(llvm::StringRef key) -> void = 0;
+  virtual auto string(llvm::StringRef value) -> void = 0;
+  virtual auto boolean(bool value) -> void = 0;
+  virtual auto number_unsigned(uint64_t value) -> void = 0;
+  virtual auto null() -> void = 0;
+};
+
+// Writes JSON text straight to a (buffered) output stream. An indent width of 0 produces compact
+// output, anything else produces the same layout as nlohmann's pretty printer. Each top-level value
+// is followed by a newline, so with compact output a sequence of values gives JSON Lines.
+class JSONTextWriter : public JSONWriter {
+public:
+  JSONTextWriter(llvm::raw_ostream &out, unsigned indent_width)
+      : out(out), indent_width(indent_width) {}
+
+  virtual auto start_object() -> void override { start_container('{'); }
+  virtual auto end_object() -> void override { end_container('}'); }
+  virtual auto start_array() -> void override { start_container('['); }
+  virtual auto end_array() -> void override { end_container(']'); }
+  virtual auto key(llvm::StringRef key) -> void override {
+    before_value();
+    write_escaped(key);
+    if (indent_width == 0) {
+      out << ':';
+    } else {
+      out << ": ";
+    }
+    after_key = true;
+  }
+  virtual auto string(llvm::StringRef value) -> void override {
+    before_value();
+    write_escaped(value);
+    after_value();
+  }
+  virtual auto boolean(bool value) -> void override {
+    before_value();
+    out << (value ? "true" : "false");
+    after_value();
+  }
+  virtual auto number_unsigned(uint64_t value) -> void override {
+    before_value();
+    char buffer[max_decimal_digits];
+    auto end = buffer + sizeof(buffer);
+    auto start = format_decimal(value, end);
+    out.write(start, end - start);
+    after_value();
+  }
+  virtual auto null() -> void override {
+    before_value();
+    out << "null";
+    after_value();
+  }
+
+  // Offset in the output of the last '{' or '[' written
+  auto last_container_start() const -> uint64_t { return container_start; }
+  // Offset in the output just after the last '}' or ']' written
+  auto last_container_end() const -> uint64_t { return container_end; }
+
+private:
+  llvm::raw_ostream &out;
+  unsigned indent_width;
+  uint64_t container_start = 0;
+  uint64_t container_end = 0;
+  // One entry per open object or array, telling if something has already been written in it.
+  llvm::SmallVector<bool, 32> has_elements;
+  bool after_key = false;
+
+  auto newline_and_indent() -> void {
+    if (indent_width != 0) {
+      out << '\n';
+      out.indent(has_elements.size() * indent_width);
+    }
+  }
+
+  auto before_value() -> void {
+    if (after_key) {
+      after_key = false;
+      return;
+    }
+    if (has_elements.empty()) {
+      return;
+    }
+    if (has_elements.back()) {
+      out << ',';
+    }
+    has_elements.back() = true;
+    newline_and_indent();
+  }
+
+  auto after_value() -> void {
+    if (has_elements.empty()) {
+      out << '\n';
+    }
+  }
+
+  auto start_container(char opening) -> void {
+    before_value();
+    container_start = out.tell();
+    out << opening;
+    has_elements.push_back(false);
+  }
+
+  auto end_container(char closing) -> void {
+    bool had_elements = has_elements.pop_back_val();
+    if (had_elements) {
+      newline_and_indent();
+    }
+    out << closing;
+    container_end = out.tell();
+    after_value();
+  }
+
+  auto write_escaped(llvm::StringRef value) -> void {
+    out << '"';
+    auto data = value.data();
+    size_t size = value.size();
+    size_t run_start = 0;
+    // Clean runs are found with find_escaped_character and copied in one write
+    for (size_t i = find_escaped_character(data, size); i < size;
+         i = run_start + find_escaped_character(data + run_start, size - run_start)) {
+      auto c = static_cast<unsigned char>(data[i]);
+      out.write(data + run_start, i - run_start);
+      run_start = i + 1;
+      switch (c) {
+      case '"':
+        out << "\\\"";
+        break;
+      case '\\':
+        out << "\\\\";
+        break;
+      case '\b':
+        out << "\\b";
+        break;
+      case '\f':
+        out << "\\f";
+        break;
+      case '\n':
+        out << "\\n";
+        break;
+      case '\r':
+        out << "\\r";
+        break;
+      case '\t':
+        out << "\\t";
+        break;
+      default: {
+        static char const hex_digits[] = "0123456789abcdef";
+        char escaped[] = {'\\', 'u', '0', '0', hex_digits[c >> 4], hex_digits[c & 0xF]};
+        out.write(escaped, sizeof(escaped));
+      } break;
+      }
+    }
+    out.write(data + run_start, size - run_start);
+    out << '"';
+  }
+};
+
+using ArenaString = std::basic_string<char, std::char_traits<char>, ArenaAllocator<char>>;
+
+// A document whose objects, arrays and strings all live in a JSONArena. The objects are small
+// sorted vectors rather than trees.
+using ArenaJSON = nlohmann::basic_json<FlatMap, std::vector, ArenaString, bool, int64_t, uint64_t,
+                                       double, ArenaAllocator>;
+
+// Builds a document from the events, for the output formats that need the whole document before
+// writing anything.
+//
+// An SDK-sized document has millions of nodes, so they are allocated in an arena owned by the
+// writer. The document is never destroyed node by node: release() (or the destruction of the
+// writer) frees it all at once.
+class JSONDOMWriter : public JSONWriter {
+public:
+  JSONDOMWriter() : scope(arena) {
+    root = new (arena.allocate(sizeof(ArenaJSON), alignof(ArenaJSON))) ArenaJSON();
+  }
+  JSONDOMWriter(JSONDOMWriter const &) = delete;
+  auto operator=(JSONDOMWriter const &) -> JSONDOMWriter & = delete;
+
+  virtual auto start_object() -> void override { stack.push_back(&add(ArenaJSON::object())); }
+  virtual auto end_object() -> void override { stack.pop_back(); }
+  virtual auto start_array() -> void override { stack.push_back(&add(ArenaJSON::array())); }
+  virtual auto end_array() -> void override { stack.pop_back(); }
+  virtual auto key(llvm::StringRef key) -> void override {
+    pending_key.assign(key.data(), key.size());
+  }
+  virtual auto string(llvm::StringRef value) -> void override {
+    add(ArenaString(value.data(), value.size()));
+  }
+  virtual auto boolean(bool value) -> void override { add(value); }
+  virtual auto number_unsigned(uint64_t value) -> void override { add(value); }
+  virtual auto null() -> void override { add(nullptr); }
+
+  auto document() -> ArenaJSON & {
+    assert(root != nullptr && "document used after release()");
+    return *root;
+  }
+
+  auto memory() const -> JSONArena const & { return arena; }
+
+  auto release() -> void {
+    stack.clear();
+    ArenaString().swap(pending_key);
+    root = nullptr;
+    arena.release();
+  }
+
+private:
+  JSONArena arena;
+  JSONArena::Scope scope;
+  ArenaJSON *root;
+  // Path from the root to the container currently being filled. Nothing is added to a container
+  // while one of its elements is on the path, so growing the vectors never invalidates the
+  // pointers.
+  std::vector<ArenaJSON *> stack;
+  ArenaString pending_key;
+
+  auto add(ArenaJSON value) -> ArenaJSON & {
+    if (stack.empty()) {
+      return *root = std::move(value);
+    }
+    auto &parent = *stack.back();
+    if (parent.is_object()) {
+      return parent[pending_key] = std::move(value);
+    }
+    parent.push_back(std::move(value));
+    return parent.back();
+  }
+};
+
+// Replays a DOM as events, for example to write it as text with a JSONTextWriter.
+inline auto write_json_document(ArenaJSON const &document, JSONWriter &writer) -> void {
+  switch (document.type()) {
+  case ArenaJSON::value_t::object:
+    writer.start_object();
+    for (auto it = document.cbegin(); it != document.cend(); ++it) {
+      writer.key({it.key().data(), it.key().size()});
+      write_json_document(it.value(), writer);
+    }
+    writer.end_object();
+    break;
+  case ArenaJSON::value_t::array:
+    writer.start_array();
+    for (auto const &element : document) {
+      write_json_document(element, writer);
+    }
+    writer.end_array();
+    break;
+  case ArenaJSON::value_t::string: {
+    auto const &value = document.get_ref<ArenaString const &>();
+    writer.string({value.data(), value.size()});
+  } break;
+  case ArenaJSON::value_t::boolean:
+    writer.boolean(document.get<bool>());
+    break;
+  case ArenaJSON::value_t::number_unsigned:
+    writer.number_unsigned(document.get<uint64_t>());
+    break;
+  default:
+    // The serializer never produces signed or floating point numbers.
+    writer.null();
+    break;
+  }
+}
+
+// Lets nlohmann's binary writers output to a raw_ostream.
+class RawOstreamOutputAdapter : public nlohmann::detail::output_adapter_protocol<char> {
+public:
+  explicit RawOstreamOutputAdapter(llvm::raw_ostream &out) : out(out) {}
+  virtual auto write_character(char c) -> void override { out << c; }
+  virtual auto write_characters(char const *s, std::size_t length) -> void override {
+    out.write(s, length);
+  }
+
+private:
+  llvm::raw_ostream &out;
+};
+
+inline auto write_cbor_document(ArenaJSON const &document, llvm::raw_ostream &out) -> void {
+  // The public to_cbor() cannot take a custom adapter so use the writer it uses internally.
+  nlohmann::detail::binary_writer<ArenaJSON, char>{
+      std::make_shared<RawOstreamOutputAdapter>(out)}
+      .write_cbor(document);
+}
+
+inline auto write_msgpack_document(ArenaJSON const &document, llvm::raw_ostream &out) -> void {
+  nlohmann::detail::binary_writer<ArenaJSON, char>{
+      std::make_shared<RawOstreamOutputAdapter>(out)}
+      .write_msgpack(document);
+}
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef CHOCOLATIER_MODULE_CLASSIFIER_HPP
+#define CHOCOLATIER_MODULE_CLASSIFIER_HPP
+
+#include "clang/AST/DeclBase.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Basic/SourceManager.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Regex.h"
+
+#include <string>
+
+// Finds the module (the lowercased framework name, "core" for the C and Objective-C runtime
+// headers) a decl belongs to from the path of its header, the same way as
+// Converter#file_module. Each file is only classified, or reported as unknown, once.
+class ModuleClassifier {
+public:
+  ModuleClassifier()
+      : framework_header(
+            "/System/Library/Frameworks/([^./]+)\\.framework/Headers/[^/.]+\\.h$"),
+        sub_framework_header("/System/Library/Frameworks/([^./]+)\\.framework/Frameworks/"
+                             "[^/.]+\\.framework/Headers/[^/.]+\\.h$"),
+        usr_include_header("/usr/include/([^/]+)/[^/.]+\\.h$"),
+        core_header("/usr/include/(mach|sys)/.+\\.h$|/lib/clang/[^/]+/include/[^./]+\\.h$|"
+                    "/usr/include/MacTypes\\.h$") {}
+
+  // Classified from the presumed file name, as Converter does from the location written. Empty,
+  // after a warning, if the file is not in a known place: only the consumer knows if it needs the
+  // decl (Converter only fails for the decls it uses).
+  auto module_of(clang::Decl const *decl) -> llvm::StringRef {
+    auto location = decl->getLocation();
+    if (location.isInvalid()) {
+      return "core";
+    }
+    auto &source_manager = decl->getASTContext().getSourceManager();
+    // Predefined decls are not in a real file
+    auto file_id = source_manager.getFileID(source_manager.getExpansionLoc(location));
+    if (source_manager.getFileEntryForID(file_id) == nullptr) {
+      return "core";
+    }
+    auto presumed_loc = source_manager.getPresumedLoc(location);
+    if (presumed_loc.isInvalid()) {
+      return "core";
+    }
+    llvm::StringRef file_name = presumed_loc.getFilename();
+    auto found = file_modules.find(file_name);
+    if (found != file_modules.end()) {
+      return found->second;
+    }
+    auto module = file_module(file_name);
+    llvm::StringRef module_name;
+    if (module.empty()) {
+      auto &diagnostics = source_manager.getDiagnostics();
+      auto diag_id = diagnostics.getCustomDiagID(clang::DiagnosticsEngine::Warning,
+                                                 "could not determine the module of %0");
+      diagnostics.Report(location, diag_id) << file_name;
+    } else {
+      // The keys of the set do not move, so they can be handed out
+      module_name = modules.insert(module).first->getKey();
+    }
+    file_modules.insert({file_name, module_name});
+    return module_name;
+  }
+
+  // Empty if the path is not in a known place.
+  auto file_module(llvm::StringRef path) -> std::string {
+    llvm::SmallVector<llvm::StringRef, 2> matches;
+    if (framework_header.match(path, &matches) || sub_framework_header.match(path, &matches)) {
+      return matches[1].lower();
+    }
+    if (usr_include_header.match(path, &matches)) {
+      if (matches[1] == "objc" || matches[1].startswith("_")) {
+        return "core";
+      }
+      return matches[1].lower();
+    }
+    if (core_header.match(path)) {
+      return "core";
+    }
+    return {};
+  }
+
+private:
+  llvm::Regex framework_header;
+  llvm::Regex sub_framework_header;
+  llvm::Regex usr_include_header;
+  llvm::Regex core_header;
+  llvm::StringSet<> modules;
+  // By file name, as #line can give several names to the same file
+  llvm::StringMap<llvm::StringRef> file_modules;
+};
+
+#endif
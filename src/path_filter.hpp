@@ -0,0 +1,70 @@
+#ifndef CHOCOLATIER_PATH_FILTER_HPP
+#define CHOCOLATIER_PATH_FILTER_HPP
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Regex.h"
+
+#include <memory>
+#include <string>
+
+// Decides from the path of the file a top-level decl comes from if it has to be serialized.
+class PathFilter {
+public:
+  PathFilter(llvm::StringRef include_regex, llvm::StringRef exclude_regex,
+             llvm::ArrayRef<std::string> frameworks) {
+    if (!include_regex.empty()) {
+      include = std::make_unique<llvm::Regex>(include_regex);
+    }
+    if (!exclude_regex.empty()) {
+      exclude = std::make_unique<llvm::Regex>(exclude_regex);
+    }
+    for (auto const &framework : frameworks) {
+      this->frameworks.insert(framework);
+    }
+  }
+
+  auto is_active() const -> bool { return include || exclude || !frameworks.empty(); }
+
+  auto accepts(llvm::StringRef path) const -> bool {
+    if (include && !include->match(path)) {
+      return false;
+    }
+    if (exclude && exclude->match(path)) {
+      return false;
+    }
+    if (!frameworks.empty() && frameworks.count(framework_name(path)) == 0 &&
+        !is_system_header(path)) {
+      return false;
+    }
+    return true;
+  }
+
+  // The Objective-C runtime, C library and compiler headers are needed with any framework, for
+  // example for NSObject, so -frameworks keeps them.
+  static auto is_system_header(llvm::StringRef path) -> bool {
+    return path.find(".framework/") == llvm::StringRef::npos &&
+           (path.find("/usr/include/") != llvm::StringRef::npos ||
+            path.find("/lib/clang/") != llvm::StringRef::npos);
+  }
+
+  // Name of the framework the path is in, the outermost one for sub-frameworks.
+  // Empty if not in a framework.
+  static auto framework_name(llvm::StringRef path) -> llvm::StringRef {
+    auto framework_end = path.find(".framework/");
+    if (framework_end == llvm::StringRef::npos) {
+      return {};
+    }
+    auto framework_path = path.take_front(framework_end);
+    // When there is no '/', rfind returns npos and npos + 1 is 0
+    return framework_path.drop_front(framework_path.rfind('/') + 1);
+  }
+
+private:
+  std::unique_ptr<llvm::Regex> include;
+  std::unique_ptr<llvm::Regex> exclude;
+  llvm::StringSet<> frameworks;
+};
+
+#endif
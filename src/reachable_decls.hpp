@@ -0,0 +1,213 @@
+#ifndef CHOCOLATIER_REACHABLE_DECLS_HPP
+#define CHOCOLATIER_REACHABLE_DECLS_HPP
+
+#include "clang/AST/Decl.h"
+#include "clang/AST/DeclObjC.h"
+#include "clang/AST/Type.h"
+#include "llvm/ADT/DenseSet.h"
+
+// The decls used by the Objective-C API: the interfaces, protocols and categories, and everything
+// their methods use through their types (typedefs, records and enums). It mirrors what
+// Converter#add_objc_defs_used_by_decl does on the output, so when only these decls are written the
+// converter still finds all it needs.
+//
+// All the redeclarations of a decl are reachable if one of them is.
+//
+// When only some roots are wanted (-roots), following every class used in a method signature would
+// quickly reach most of the SDK. So with expand_referenced_classes false, the classes only seen in
+// types (and their super classes) are just referenced: they are written as forward declarations.
+class ReachableDecls {
+public:
+  explicit ReachableDecls(bool expand_referenced_classes = true)
+      : expand_referenced_classes(expand_referenced_classes) {}
+
+  // Only definitions are roots, @class and @protocol forward declarations are not.
+  static auto is_root(clang::Decl const *decl) -> bool {
+    if (auto const interface = llvm::dyn_cast<clang::ObjCInterfaceDecl>(decl)) {
+      return interface->isThisDeclarationADefinition();
+    }
+    if (auto const protocol = llvm::dyn_cast<clang::ObjCProtocolDecl>(decl)) {
+      return protocol->isThisDeclarationADefinition();
+    }
+    return llvm::isa<clang::ObjCCategoryDecl>(decl);
+  }
+
+  auto add_root(clang::Decl const *decl) -> void { add_decl(decl); }
+
+  auto contains(clang::Decl const *decl) const -> bool {
+    auto canonical_decl = decl->getCanonicalDecl();
+    return decls.count(canonical_decl) != 0 || referenced_classes.count(canonical_decl) != 0;
+  }
+
+  // If the decl must be written as a forward declaration, without its methods.
+  auto is_only_referenced(clang::Decl const *decl) const -> bool {
+    auto canonical_decl = decl->getCanonicalDecl();
+    return decls.count(canonical_decl) == 0 && referenced_classes.count(canonical_decl) != 0;
+  }
+
+  auto size() const -> size_t { return decls.size(); }
+
+private:
+  bool expand_referenced_classes;
+  llvm::DenseSet<clang::Decl const *> decls;
+  llvm::DenseSet<clang::Decl const *> referenced_classes;
+  llvm::DenseSet<clang::Type const *> visited_types;
+
+  auto add_decl(clang::Decl const *decl) -> void {
+    if (!decls.insert(decl->getCanonicalDecl()).second) {
+      return;
+    }
+    switch (decl->getKind()) {
+    case clang::Decl::ObjCInterface: {
+      auto interface = static_cast<clang::ObjCInterfaceDecl const *>(decl);
+      if (interface->hasDefinition()) {
+        interface = interface->getDefinition();
+        if (auto const super_class = interface->getSuperClass()) {
+          add_decl(super_class);
+        }
+        add_protocols(interface->protocols());
+        for (auto const category : interface->visible_categories()) {
+          add_decl(category);
+        }
+      }
+      add_methods(interface);
+    } break;
+    case clang::Decl::ObjCProtocol: {
+      auto protocol = static_cast<clang::ObjCProtocolDecl const *>(decl);
+      if (protocol->hasDefinition()) {
+        protocol = protocol->getDefinition();
+        add_protocols(protocol->protocols());
+      }
+      add_methods(protocol);
+    } break;
+    case clang::Decl::ObjCCategory: {
+      auto category = static_cast<clang::ObjCCategoryDecl const *>(decl);
+      add_protocols(category->protocols());
+      add_methods(category);
+    } break;
+    case clang::Decl::Typedef:
+    case clang::Decl::TypeAlias:
+      add_type(static_cast<clang::TypedefNameDecl const *>(decl)->getUnderlyingType());
+      break;
+    case clang::Decl::Record: {
+      auto record = static_cast<clang::RecordDecl const *>(decl)->getDefinition();
+      if (record != nullptr) {
+        for (auto const field : record->fields()) {
+          add_type(field->getType());
+        }
+      }
+    } break;
+    case clang::Decl::Enum: {
+      auto integer_type = static_cast<clang::EnumDecl const *>(decl)->getIntegerType();
+      if (!integer_type.isNull()) {
+        add_type(integer_type);
+      }
+    } break;
+    default:
+      break;
+    }
+  }
+
+  template <class ProtocolRange>
+  auto add_protocols(ProtocolRange const &protocols) -> void {
+    for (auto const protocol : protocols) {
+      add_decl(protocol);
+    }
+  }
+
+  // The super classes are needed too as forward declarations refer to them.
+  auto add_referenced_class(clang::ObjCInterfaceDecl const *interface) -> void {
+    if (!referenced_classes.insert(interface->getCanonicalDecl()).second) {
+      return;
+    }
+    if (interface->hasDefinition()) {
+      if (auto const super_class = interface->getSuperClass()) {
+        add_referenced_class(super_class);
+      }
+    }
+  }
+
+  auto add_methods(clang::ObjCContainerDecl const *container) -> void {
+    for (auto const child_decl : container->decls()) {
+      auto method = llvm::dyn_cast<clang::ObjCMethodDecl>(child_decl);
+      if (method == nullptr) {
+        continue;
+      }
+      add_type(method->getReturnType());
+      for (auto const param : method->parameters()) {
+        add_type(param->getType());
+      }
+    }
+  }
+
+  auto add_type(clang::QualType qual_type) -> void { add_type(qual_type.getTypePtr()); }
+
+  // Follows the same parts of the types as Converter#add_objc_defs_used_by_type.
+  auto add_type(clang::Type const *type) -> void {
+    if (!visited_types.insert(type).second) {
+      return;
+    }
+    switch (type->getTypeClass()) {
+    case clang::Type::Typedef:
+      add_decl(static_cast<clang::TypedefType const *>(type)->getDecl());
+      break;
+    case clang::Type::Record:
+    case clang::Type::Enum:
+      add_decl(static_cast<clang::TagType const *>(type)->getDecl());
+      break;
+    case clang::Type::Attributed:
+      add_type(static_cast<clang::AttributedType const *>(type)->getModifiedType());
+      break;
+    case clang::Type::Pointer:
+      add_type(static_cast<clang::PointerType const *>(type)->getPointeeType());
+      break;
+    case clang::Type::Decayed:
+      add_type(static_cast<clang::DecayedType const *>(type)->getPointeeType());
+      break;
+    case clang::Type::ObjCObjectPointer:
+      add_type(static_cast<clang::ObjCObjectPointerType const *>(type)->getPointeeType());
+      break;
+    case clang::Type::BlockPointer:
+      add_type(static_cast<clang::BlockPointerType const *>(type)->getPointeeType());
+      break;
+    case clang::Type::ObjCInterface:
+    case clang::Type::ObjCObject: {
+      auto objc_obj_type = static_cast<clang::ObjCObjectType const *>(type);
+      // id and Class have a builtin base type, and no interface
+      auto interface = objc_obj_type->getInterface();
+      if (interface == nullptr) {
+        break;
+      }
+      if (expand_referenced_classes) {
+        add_decl(interface);
+      } else {
+        add_referenced_class(interface);
+      }
+    } break;
+    case clang::Type::Elaborated:
+      add_type(static_cast<clang::ElaboratedType const *>(type)->getNamedType());
+      break;
+    case clang::Type::FunctionProto: {
+      auto function_proto_type = static_cast<clang::FunctionProtoType const *>(type);
+      for (auto const param_type : function_proto_type->getParamTypes()) {
+        add_type(param_type);
+      }
+      add_type(function_proto_type->getReturnType());
+    } break;
+    case clang::Type::FunctionNoProto:
+      add_type(static_cast<clang::FunctionNoProtoType const *>(type)->getReturnType());
+      break;
+    case clang::Type::Paren:
+      add_type(static_cast<clang::ParenType const *>(type)->getInnerType());
+      break;
+    case clang::Type::ConstantArray:
+    case clang::Type::IncompleteArray:
+      add_type(static_cast<clang::ArrayType const *>(type)->getElementType());
+      break;
+    default:
+      break;
+    }
+  }
+};
+
+#endif
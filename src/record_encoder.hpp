@@ -0,0 +1,168 @@
+#ifndef CHOCOLATIER_RECORD_ENCODER_HPP
+#define CHOCOLATIER_RECORD_ENCODER_HPP
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/SmallVector.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+// Typed records are plain structs listing their fields in a constexpr table: the key of each field
+// in the output, the member holding its value, and the -fields bit selecting it (0 when always
+// written). The table is the only description of the record's schema, the encoder below writes
+// any record from it, choosing the writer call of each field from the type of its member at
+// compile time.
+//
+// A record declares its table as:
+//   static constexpr auto fields() {
+//     return std::make_tuple(record_field("name", &Record::name, FieldName), ...);
+//   }
+template <class Record, class Value>
+struct RecordField {
+  char const *key;
+  Value Record::*member;
+  uint32_t mask;
+};
+
+template <class Record, class Value>
+constexpr auto record_field(char const *key, Value Record::*member, uint32_t mask = 0)
+    -> RecordField<Record, Value> {
+  return {key, member, mask};
+}
+
+// A boolean only written when true.
+struct Flag {
+  bool value;
+};
+
+// An optional field, or a Flag, is left out entirely when not set.
+template <class T>
+auto is_present(T const &) -> bool {
+  return true;
+}
+template <class T>
+auto is_present(llvm::Optional<T> const &value) -> bool {
+  return value.hasValue();
+}
+inline auto is_present(Flag flag) -> bool { return flag.value; }
+
+template <class T, class = void>
+struct IsRecord : std::false_type {};
+template <class T>
+struct IsRecord<T, decltype(T::fields(), void())> : std::true_type {};
+
+// For each field of the table, calls function(field).
+template <class Tuple, class Function, size_t... Indices>
+auto for_each_record_field(Tuple const &fields, Function function, std::index_sequence<Indices...>)
+    -> void {
+  int expand[] = {0, (function(std::get<Indices>(fields)), 0)...};
+  (void)expand;
+}
+
+template <class Record, class Function>
+auto for_each_record_field(Function function) -> void {
+  constexpr auto fields = Record::fields();
+  for_each_record_field(fields, function,
+                        std::make_index_sequence<std::tuple_size<decltype(fields)>::value>());
+}
+
+// Writes records to a Sink with the same events as JSONWriter, plus:
+// - value(v) for the leaf values (the members that are not records, arrays or optionals),
+// - mask_of(record) giving the field mask of a nested record.
+template <class Sink>
+class RecordEncoder {
+public:
+  explicit RecordEncoder(Sink &sink) : sink(sink) {}
+
+  template <class Record>
+  auto encode(Record const &record) -> void {
+    sink.start_object();
+    encode_fields(record, sink.mask_of(record));
+    sink.end_object();
+  }
+
+  // Only the fields, for a record that is the end of an object already started.
+  template <class Record>
+  auto encode_fields(Record const &record, uint32_t mask) -> void {
+    for_each_record_field<Record>([&](auto const &field) {
+      if (field.mask != 0 && (field.mask & mask) == 0) {
+        return;
+      }
+      auto const &value = record.*field.member;
+      if (!is_present(value)) {
+        return;
+      }
+      sink.key(field.key);
+      encode_value(value);
+    });
+  }
+
+private:
+  Sink &sink;
+
+  auto encode_value(Flag) -> void { sink.boolean(true); }
+
+  template <class T>
+  auto encode_value(llvm::Optional<T> const &value) -> void {
+    encode_value(*value);
+  }
+
+  template <class T, unsigned N>
+  auto encode_value(llvm::SmallVector<T, N> const &values) -> void {
+    sink.start_array();
+    for (auto const &value : values) {
+      encode_value(value);
+    }
+    sink.end_array();
+  }
+
+  template <class T>
+  auto encode_value(T const &value) -> std::enable_if_t<IsRecord<T>::value> {
+    encode(value);
+  }
+
+  template <class T>
+  auto encode_value(T const &value) -> std::enable_if_t<!IsRecord<T>::value> {
+    sink.value(value);
+  }
+};
+
+constexpr auto field_names_equal(char const *a, char const *b) -> bool {
+  while (*a != '\0' && *a == *b) {
+    ++a;
+    ++b;
+  }
+  return *a == *b;
+}
+
+// Checks at compile time that the keys of a record are the names -fields uses for their bits.
+template <size_t Index = 0, class Tuple, class Names>
+constexpr auto record_keys_match(Tuple const &, Names const &)
+    -> std::enable_if_t<(Index == std::tuple_size<Tuple>::value), bool> {
+  return true;
+}
+template <size_t Index = 0, class Tuple, class Names>
+constexpr auto record_keys_match(Tuple const &fields, Names const &names)
+    -> std::enable_if_t<(Index < std::tuple_size<Tuple>::value), bool> {
+  auto const &field = std::get<Index>(fields);
+  if (field.mask != 0) {
+    bool found = false;
+    for (auto const &name : names) {
+      if (name.field == field.mask) {
+        if (!field_names_equal(name.name, field.key)) {
+          return false;
+        }
+        found = true;
+      }
+    }
+    if (!found) {
+      return false;
+    }
+  }
+  return record_keys_match<Index + 1>(fields, names);
+}
+
+#endif
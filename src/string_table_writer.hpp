@@ -0,0 +1,161 @@
+#ifndef CHOCOLATIER_STRING_TABLE_WRITER_HPP
+#define CHOCOLATIER_STRING_TABLE_WRITER_HPP
+
+#include "json_writer.hpp"
+#include "string_table.hpp"
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <algorithm>
+#include <numeric>
+#include <vector>
+
+// Sits in front of another writer and replaces the values of the keys that repeat the most (USRs,
+// selectors, names and file paths) by their id in a front-coded string table (see
+// string_table.hpp). The ids are given in the order the strings are first seen, as they are
+// written before the table is complete. The table itself must be written with write_table() once
+// everything else has been written.
+class StringTableWriter : public JSONWriter {
+public:
+  explicit StringTableWriter(JSONWriter &inner) : inner(inner) {}
+
+  virtual auto start_object() -> void override {
+    inner.start_object();
+    containers.push_back(Container{false, false});
+  }
+  virtual auto end_object() -> void override {
+    containers.pop_back();
+    inner.end_object();
+  }
+  virtual auto start_array() -> void override {
+    inner.start_array();
+    containers.push_back(Container{true, value_is_encoded()});
+  }
+  virtual auto end_array() -> void override {
+    containers.pop_back();
+    inner.end_array();
+  }
+  virtual auto key(llvm::StringRef key) -> void override {
+    key_is_encoded = is_encoded_key(key);
+    inner.key(key);
+  }
+  virtual auto string(llvm::StringRef value) -> void override {
+    if (value_is_encoded()) {
+      inner.number_unsigned(string_id(value));
+    } else {
+      inner.string(value);
+    }
+  }
+  virtual auto boolean(bool value) -> void override { inner.boolean(value); }
+  virtual auto number_unsigned(uint64_t value) -> void override { inner.number_unsigned(value); }
+  virtual auto null() -> void override { inner.null(); }
+
+  // Writes the "string_table" key and the table in the current object. The ids are already written
+  // in the order the strings were first seen, the table stores the strings sorted so that they
+  // share long prefixes, and the position of each id in it.
+  auto write_table() -> void {
+    std::vector<unsigned> sorted_ids(strings.size());
+    std::iota(sorted_ids.begin(), sorted_ids.end(), 0);
+    std::sort(sorted_ids.begin(), sorted_ids.end(),
+              [this](unsigned a, unsigned b) { return strings[a] < strings[b]; });
+    std::vector<llvm::StringRef> sorted_strings;
+    sorted_strings.reserve(strings.size());
+    std::vector<unsigned> positions(strings.size());
+    for (size_t position = 0; position < sorted_ids.size(); ++position) {
+      sorted_strings.push_back(strings[sorted_ids[position]]);
+      positions[sorted_ids[position]] = static_cast<unsigned>(position);
+    }
+
+    inner.key("string_table");
+    inner.start_object();
+    inner.key("block_size");
+    inner.number_unsigned(string_table::default_block_size);
+    inner.key("keys");
+    inner.start_array();
+    for (auto const key : encoded_keys()) {
+      inner.string(key);
+    }
+    inner.end_array();
+    inner.key("positions");
+    inner.start_array();
+    for (auto const position : positions) {
+      inner.number_unsigned(position);
+    }
+    inner.end_array();
+    inner.key("prefix_lengths");
+    inner.start_array();
+    for (size_t i = 0; i < sorted_strings.size(); ++i) {
+      inner.number_unsigned(prefix_length(sorted_strings, i));
+    }
+    inner.end_array();
+    inner.key("suffixes");
+    inner.start_array();
+    for (size_t i = 0; i < sorted_strings.size(); ++i) {
+      inner.string(sorted_strings[i].drop_front(prefix_length(sorted_strings, i)));
+    }
+    inner.end_array();
+    inner.end_object();
+  }
+
+private:
+  struct Container {
+    bool is_array;
+    // For arrays, if their elements are encoded
+    bool is_encoded;
+  };
+
+  JSONWriter &inner;
+  llvm::SmallVector<Container, 32> containers;
+  bool key_is_encoded = false;
+  llvm::StringMap<unsigned> string_ids;
+  std::vector<llvm::StringRef> strings;
+
+  static auto encoded_keys() -> llvm::ArrayRef<char const *> {
+    static char const *const keys[] = {"usr",  "super_class_usr", "decl_usr", "interface_usr",
+                                       "selector", "name", "file",  "usrs",     "files"};
+    return keys;
+  }
+
+  static auto is_encoded_key(llvm::StringRef key) -> bool {
+    for (auto const encoded_key : encoded_keys()) {
+      if (key == encoded_key) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  auto value_is_encoded() const -> bool {
+    if (containers.empty()) {
+      return false;
+    }
+    if (containers.back().is_array) {
+      return containers.back().is_encoded;
+    }
+    return key_is_encoded;
+  }
+
+  auto string_id(llvm::StringRef value) -> unsigned {
+    auto next_id = static_cast<unsigned>(strings.size());
+    auto inserted = string_ids.insert(std::make_pair(value, next_id));
+    if (inserted.second) {
+      strings.push_back(inserted.first->getKey());
+    }
+    return inserted.first->second;
+  }
+
+  static auto prefix_length(std::vector<llvm::StringRef> const &sorted_strings, size_t i)
+      -> uint32_t {
+    if (i % string_table::default_block_size == 0) {
+      return 0;
+    }
+    auto previous = sorted_strings[i - 1];
+    auto current = sorted_strings[i];
+    return string_table::shared_prefix_length(previous.data(), previous.size(), current.data(),
+                                              current.size());
+  }
+};
+
+#endif
@@ -0,0 +1,99 @@
+#ifndef CHOCOLATIER_TEXT_ENCODING_HPP
+#define CHOCOLATIER_TEXT_ENCODING_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Helpers for JSONTextWriter. Most of the output is strings (USRs, selectors, names and paths)
+// that almost never need escaping, so they are scanned as many bytes at a time as the target
+// allows and copied in bulk.
+
+// Index of the first character of data that must be escaped in a JSON string (a control
+// character, '"' or '\\'), or size if there is none. One byte at a time.
+inline auto find_escaped_character_scalar(char const *data, size_t size) -> size_t {
+  for (size_t i = 0; i < size; ++i) {
+    auto c = static_cast<unsigned char>(data[i]);
+    if (c < 0x20 || c == '"' || c == '\\') {
+      return i;
+    }
+  }
+  return size;
+}
+
+// Same as find_escaped_character_scalar, 32 bytes at a time with AVX2 or 16 with SSE2 (always
+// there on x86-64).
+inline auto find_escaped_character(char const *data, size_t size) -> size_t {
+  size_t i = 0;
+#if defined(__AVX2__)
+  auto const quote32 = _mm256_set1_epi8('"');
+  auto const backslash32 = _mm256_set1_epi8('\\');
+  auto const last_control32 = _mm256_set1_epi8(0x1F);
+  for (; i + 32 <= size; i += 32) {
+    auto chunk = _mm256_loadu_si256(reinterpret_cast<__m256i const *>(data + i));
+    // max(c, 0x1F) == 0x1F is an unsigned c <= 0x1F
+    auto is_control = _mm256_cmpeq_epi8(_mm256_max_epu8(chunk, last_control32), last_control32);
+    auto needs_escape = _mm256_or_si256(
+        is_control, _mm256_or_si256(_mm256_cmpeq_epi8(chunk, quote32),
+                                    _mm256_cmpeq_epi8(chunk, backslash32)));
+    auto mask = static_cast<uint32_t>(_mm256_movemask_epi8(needs_escape));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+  auto const quote = _mm_set1_epi8('"');
+  auto const backslash = _mm_set1_epi8('\\');
+  auto const last_control = _mm_set1_epi8(0x1F);
+  for (; i + 16 <= size; i += 16) {
+    auto chunk = _mm_loadu_si128(reinterpret_cast<__m128i const *>(data + i));
+    auto is_control = _mm_cmpeq_epi8(_mm_max_epu8(chunk, last_control), last_control);
+    auto needs_escape = _mm_or_si128(
+        is_control, _mm_or_si128(_mm_cmpeq_epi8(chunk, quote), _mm_cmpeq_epi8(chunk, backslash)));
+    auto mask = static_cast<uint32_t>(_mm_movemask_epi8(needs_escape));
+    if (mask != 0) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#endif
+  return i + find_escaped_character_scalar(data + i, size - i);
+}
+
+// Large enough for any uint64_t in decimal.
+constexpr size_t max_decimal_digits = 20;
+
+// Writes value in decimal just before end and returns where it starts. Two digits at a time from
+// a table, instead of the generic path of raw_ostream.
+inline auto format_decimal(uint64_t value, char *end) -> char * {
+  static char const digit_pairs[] = "00010203040506070809"
+                                    "10111213141516171819"
+                                    "20212223242526272829"
+                                    "30313233343536373839"
+                                    "40414243444546474849"
+                                    "50515253545556575859"
+                                    "60616263646566676869"
+                                    "70717273747576777879"
+                                    "80818283848586878889"
+                                    "90919293949596979899";
+  auto start = end;
+  while (value >= 100) {
+    auto pair = static_cast<size_t>(value % 100) * 2;
+    value /= 100;
+    start -= 2;
+    std::memcpy(start, digit_pairs + pair, 2);
+  }
+  if (value >= 10) {
+    start -= 2;
+    std::memcpy(start, digit_pairs + value * 2, 2);
+  } else {
+    *--start = static_cast<char>('0' + value);
+  }
+  return start;
+}
+
+#endif